@@ -678,6 +678,113 @@ EX const landtype linf[landtypes] = {
   #include "content.cpp"
   };
 
+// --- columnar flag indices ---
+
+#if HDR
+/** \brief the flags of minf, iinf or linf stored column-wise, plus a bitset over all ids for every flag bit
+ *
+ *  Flag tests through this index do not touch the glyphs, names and help texts which are interleaved
+ *  with the flags in the original tables. Queries like "all monsters with CF_FLYING | CF_GHOST" are
+ *  computed by combining whole bitsets rather than scanning the table.
+ */
+template<int N> struct flag_index {
+  flagtype flags[N];
+  array<std::bitset<N>, 64> with;
+
+  template<class T> void build(const T *table) {
+    for(auto& b: with) b.reset();
+    for(int i=0; i<N; i++) {
+      flags[i] = table[i].flags;
+      for(int j=0; j<64; j++) if(flags[i] & Flag(j)) with[j].set(i);
+      }
+    }
+
+  bool has(int id, flagtype f) const { return flags[id] & f; }
+
+  /** \brief ids which have at least one of the flags in f */
+  std::bitset<N> any(flagtype f) const {
+    std::bitset<N> res;
+    for(int j=0; j<64; j++) if(f & Flag(j)) res |= with[j];
+    return res;
+    }
+
+  /** \brief ids which have all the flags in f (all ids if f is 0) */
+  std::bitset<N> all(flagtype f) const {
+    std::bitset<N> res;
+    res.set();
+    for(int j=0; j<64; j++) if(f & Flag(j)) res &= with[j];
+    return res;
+    }
+
+  /** \brief convert the result of a query to a list, e.g., ids<eMonster>(monster_flags.any(CF_GHOST)) */
+  template<class T> static vector<T> ids(const std::bitset<N>& b) {
+    vector<T> res;
+    for(int i=0; i<N; i++) if(b[i]) res.push_back(T(i));
+    return res;
+    }
+  };
+#endif
+
+EX flag_index<motypes> monster_flags;
+EX flag_index<ittypes> item_flags;
+EX flag_index<landtypes> land_flags;
+
+/** \brief recompute monster_flags, item_flags and land_flags; needs to be called after changing the flags in minf, iinf or linf */
+EX void build_flag_indices() {
+  monster_flags.build(minf);
+  item_flags.build(iinf);
+  land_flags.build(linf);
+  }
+
+int flag_indices_built = (build_flag_indices(), 0);
+
+// --- compile-time flag tables ---
+
+#if HDR
+/** \brief the flags of minf, iinf and linf as generated from content.cpp, available at compile time
+ *
+ *  minf and iinf themselves stay mutable, since their entries are changed at runtime (and by mods),
+ *  so monster_flags_ce and item_flags_ce are only the defaults: they always contain the original
+ *  flags. Code which needs to respect runtime changes has to use the flags in minf/iinf (or
+ *  monster_flags etc.). linf is const, so land_flags_ce always equals its flags.
+ */
+constexpr flagtype monster_flags_ce[motypes] = {
+  #define MONSTER(a,b,c,d,e,f,g,h) e,
+  #include "content.cpp"
+  };
+
+constexpr flagtype item_flags_ce[ittypes] = {
+  #define ITEM(a,b,c,d,e,f,g,h,i) f,
+  #include "content.cpp"
+  };
+
+constexpr flagtype land_flags_ce[landtypes] = {
+  #define LAND(a,b,c,d,e,f,g) d,
+  #include "content.cpp"
+  };
+
+/** \brief for a given flag F, a table of booleans saying which entries of a flag table have F */
+template<int N, const flagtype (&table)[N], flagtype F> struct flag_predicate {
+  bool value[N];
+  constexpr flag_predicate() : value() {
+    for(int i=0; i<N; i++) value[i] = (table[i] & F) != 0;
+    }
+  static const flag_predicate instance;
+  };
+
+template<int N, const flagtype (&table)[N], flagtype F> constexpr flag_predicate<N, table, F> flag_predicate<N, table, F>::instance = {};
+
+/** \brief does the monster m have the flag F by default, i.e., in content.cpp (e.g., has_default_flag<CF_GHOST>(m))
+ *
+ *  Folds to a constant if m is known at compile time, and is a single byte lookup otherwise. This
+ *  ignores runtime changes to minf/iinf, so it is not a replacement for testing their flags (for
+ *  lands, it is equivalent, since linf is const).
+ */
+template<flagtype F> constexpr bool has_default_flag(eMonster m) { return flag_predicate<motypes, monster_flags_ce, F>::instance.value[m]; }
+template<flagtype F> constexpr bool has_default_flag(eItem it) { return flag_predicate<ittypes, item_flags_ce, F>::instance.value[it]; }
+template<flagtype F> constexpr bool has_default_flag(eLand l) { return flag_predicate<landtypes, land_flags_ce, F>::instance.value[l]; }
+#endif
+
 #if HDR
 struct landtacinfo { eLand l; int tries, multiplier; };
 #endif
@@ -831,9 +938,15 @@ static const int SEE_ALL = 50;
 // note: check_football_colorability in arbitrile.cpp assumes OINF is divisible by 3
 static const int OINF = 123;
 
+#if CAP_FIXED_GEOMETRY
+/** const, so that code which would switch the geometry fails to compile in a fixed-geometry build */
+extern const eGeometry geometry;
+extern const eVariation variation;
+#else
 extern eGeometry geometry;
 extern eVariation variation;
 #endif
+#endif
 
 #if HDR
 static const flagtype qsNONOR           = qANYQ | qSMALL | qCLOSED | qNONORIENTABLE;
@@ -955,6 +1068,25 @@ EX vector<geometryinfo> ginf = {
   };
   // bits: 9, 10, 15, 16, (reserved for later) 17, 18
 
+#if CAP_FIXED_GEOMETRY
+/** \brief the macros are compiled with the FIXED_* constants, so they have to describe ginf[FIXED_GEOMETRY]
+ *
+ *  ginf is not constexpr, so this cannot be a static_assert; it is checked whenever a game starts.
+ */
+EX void check_fixed_geometry() {
+  auto& gi = ginf[FIXED_GEOMETRY];
+  if(gi.sides == FIXED_S7 && gi.vertex == FIXED_S3 && gi.g.kind == FIXED_CLASS && gi.flags == flagtype(FIXED_FLAGS) && gi.g.gameplay_dimension == FIXED_DIM && gi.g.graphical_dimension == FIXED_DIM)
+    return;
+  println(hlog, "fixed geometry profile does not agree with ginf[", gi.tiling_name, "]: sides ", gi.sides, "/", FIXED_S7, ", vertex ", gi.vertex, "/", FIXED_S3, ", dimension ", gi.g.gameplay_dimension, "/", FIXED_DIM);
+  throw hr_exception("fixed geometry profile does not agree with ginf");
+  }
+
+auto ah_fixed_geometry = addHook(hooks_initgame, 100, check_fixed_geometry);
+#endif
+
+/** ginf is defined above in this file, so it is already initialized here */
+int active_geometry_ready = (refresh_active_geometry(), 0);
+
 #if HDR
 namespace mf {
   static const flagtype azimuthal = 1;
@@ -1084,6 +1216,150 @@ EX vector<modelinfo> mdinf = {
 #undef X3
 #undef DEFAULTS
 
+// --- name lookup ---
+
+#if HDR
+/** \brief a minimal perfect hash from names to ids, using hash-and-displace
+ *
+ *  Every bucket (selected by the unseeded hash) stores the seed which places all its names in distinct
+ *  slots; a lookup computes two hashes and compares one string. If a name appears more than once in
+ *  the table, the first id is used, just like in a linear scan.
+ */
+struct name_index {
+  vector<int> seed_of_bucket;
+  vector<string> name_at;
+  vector<int> id_at;
+
+  static unsigned long long hash(const string& s, unsigned long long seed) {
+    unsigned long long h = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+    for(unsigned char ch: s) h = (h ^ ch) * 1099511628211ull;
+    return h ^ (h >> 29);
+    }
+
+  void build(const vector<pair<string, int>>& names);
+
+  /** \brief the id of the given name, or -1 */
+  int find(const string& s) const {
+    if(name_at.empty()) return -1;
+    int n = isize(name_at);
+    int seed = seed_of_bucket[hash(s, 0) % n];
+    if(!seed) return -1;
+    int slot = hash(s, seed) % n;
+    return name_at[slot] == s ? id_at[slot] : -1;
+    }
+  };
+#endif
+
+void name_index::build(const vector<pair<string, int>>& names) {
+  vector<pair<string, int>> unique;
+  set<string> seen;
+  for(auto& p: names) if(!seen.count(p.first)) seen.insert(p.first), unique.push_back(p);
+  int n = isize(unique);
+  seed_of_bucket.assign(n, 0);
+  name_at.assign(n, "");
+  id_at.assign(n, -1);
+  if(!n) return;
+
+  vector<vector<int>> buckets(n);
+  for(int i=0; i<n; i++) buckets[hash(unique[i].first, 0) % n].push_back(i);
+  vector<int> order(n);
+  for(int i=0; i<n; i++) order[i] = i;
+  stable_sort(order.begin(), order.end(), [&] (int a, int b) { return isize(buckets[a]) > isize(buckets[b]); });
+
+  vector<bool> used(n, false);
+  vector<int> slots;
+  for(int b: order) {
+    auto& bucket = buckets[b];
+    if(bucket.empty()) break;
+    for(int seed=1;; seed++) {
+      slots.clear();
+      bool ok = true;
+      for(int i: bucket) {
+        int slot = hash(unique[i].first, seed) % n;
+        if(used[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) { ok = false; break; }
+        slots.push_back(slot);
+        }
+      if(!ok) continue;
+      seed_of_bucket[b] = seed;
+      for(int j=0; j<isize(bucket); j++) {
+        used[slots[j]] = true;
+        name_at[slots[j]] = unique[bucket[j]].first;
+        id_at[slots[j]] = unique[bucket[j]].second;
+        }
+      break;
+      }
+    }
+  }
+
+EX name_index monster_names, item_names, land_names, geometry_shortnames, geometry_tiling_names;
+
+/** \brief all monsters (or items) with the given glyph, in the order of minf (or iinf) */
+EX array<vector<eMonster>, 256> monster_glyphs;
+EX array<vector<eItem>, 256> item_glyphs;
+
+/** \brief recompute the name and glyph lookup tables; needs to be called after minf, iinf, linf or ginf are changed */
+EX void build_name_indices() {
+  vector<pair<string, int>> names;
+  for(int i=0; i<motypes; i++) names.emplace_back(minf[i].name, i);
+  monster_names.build(names);
+  names.clear();
+  for(int i=0; i<ittypes; i++) names.emplace_back(iinf[i].name, i);
+  item_names.build(names);
+  names.clear();
+  for(int i=0; i<landtypes; i++) names.emplace_back(linf[i].name, i);
+  land_names.build(names);
+  names.clear();
+  for(int i=0; i<isize(ginf); i++) names.emplace_back(ginf[i].shortname, i);
+  geometry_shortnames.build(names);
+  names.clear();
+  for(int i=0; i<isize(ginf); i++) names.emplace_back(ginf[i].tiling_name, i);
+  geometry_tiling_names.build(names);
+
+  for(auto& v: monster_glyphs) v.clear();
+  for(int i=0; i<motypes; i++) monster_glyphs[(unsigned char) minf[i].glyph].push_back(eMonster(i));
+  for(auto& v: item_glyphs) v.clear();
+  for(int i=0; i<ittypes; i++) item_glyphs[(unsigned char) iinf[i].glyph].push_back(eItem(i));
+  }
+
+int name_indices_built = (build_name_indices(), 0);
+
+/** \brief the monster called name, or moNone */
+EX eMonster find_monster(const string& name) {
+  int id = monster_names.find(name);
+  return id < 0 ? moNone : eMonster(id);
+  }
+
+/** \brief the item called name, or itNone */
+EX eItem find_item(const string& name) {
+  int id = item_names.find(name);
+  return id < 0 ? itNone : eItem(id);
+  }
+
+/** \brief the land called name, or laNone */
+EX eLand find_land(const string& name) {
+  int id = land_names.find(name);
+  return id < 0 ? laNone : eLand(id);
+  }
+
+/** \brief the geometry with the given shortname, or else the first one with the given tiling_name; gGUARD if none */
+EX eGeometry find_geometry(const string& name) {
+  int id = geometry_shortnames.find(name);
+  if(id < 0) id = geometry_tiling_names.find(name);
+  return id < 0 ? gGUARD : eGeometry(id);
+  }
+
+/** \brief the first monster with the given glyph, or moNone */
+EX eMonster find_monster_by_glyph(char glyph) {
+  auto& v = monster_glyphs[(unsigned char) glyph];
+  return v.empty() ? moNone : v[0];
+  }
+
+/** \brief the first item with the given glyph, or itNone */
+EX eItem find_item_by_glyph(char glyph) {
+  auto& v = item_glyphs[(unsigned char) glyph];
+  return v.empty() ? itNone : v[0];
+  }
+
 #if HDR
 static inline bool orbProtection(eItem it) { return false; } // not implemented
 
@@ -0,0 +1,239 @@
+// Hyperbolic Rogue -- drawing pipeline profiler
+// Copyright (C) 2011-2019 Zeno Rogue, see 'hyper.cpp' for details
+
+/** \file drawprof.cpp
+ *  \brief scoped timers and counters for the drawing pipeline
+ *
+ *  Everything here is compiled in only with CAP_DRAWPROF; otherwise DRAWPROF_SCOPE,
+ *  DRAWPROF_COUNT and DRAWPROF_VALUE expand to nothing. Each probe accumulates the number of calls
+ *  and the total time per frame; counters (cells_drawn, cells_generated) only accumulate a value.
+ *  A frame ends when hrmap::draw_all starts drawing the next one; drawprof::end_frame() then moves
+ *  the numbers into per-probe histograms, which can be exported as JSON. When drawprof::tracing is
+ *  on, individual scopes are also recorded and can be exported in the Chrome trace event format
+ *  (chrome://tracing, Perfetto).
+ *
+ *  From the command line, -drawprof-json and -drawprof-trace name the files to export to; they are
+ *  written at exit, or after -drawprof-frames frames.
+ */
+
+#include "hyper.h"
+namespace hr {
+
+#if HDR
+#if CAP_DRAWPROF
+#define DRAWPROF_CAT2(a,b) a##b
+#define DRAWPROF_CAT(a,b) DRAWPROF_CAT2(a,b)
+#define DRAWPROF_SCOPE(id) drawprof::scoped_timer DRAWPROF_CAT(drawprof_timer_, __LINE__)(drawprof::id)
+#define DRAWPROF_COUNT(id) drawprof::count(drawprof::id)
+#define DRAWPROF_VALUE(id, v) drawprof::set_value(drawprof::id, v)
+#else
+#define DRAWPROF_SCOPE(id)
+#define DRAWPROF_COUNT(id)
+#define DRAWPROF_VALUE(id, v)
+#endif
+#endif
+
+#if CAP_DRAWPROF
+EX namespace drawprof {
+
+#if HDR
+  enum eProbe {
+    dpOptimizeview, dpCenterpc, dpDrawAll, dpDoDraw, dpInSmartRange, dpDrawBoundary, dpLimitedGeneration,
+    /** counters: calls is the value, and nanos is unused */
+    dpCellsDrawn, dpCellsGenerated,
+    /** applymodel for model md is dpApplymodel + md */
+    dpApplymodel
+    };
+
+  static const int max_probes = dpApplymodel + 64;
+  static const int histogram_buckets = 24;
+
+  struct probe_stats {
+    /** in the current frame */
+    long long calls, nanos;
+    /** over all finished frames */
+    long long total_calls, total_nanos;
+    /** bucket i counts frames where this probe took [2^(i-1), 2^i) microseconds (for counters: where the value was in
+     *  [2^(i-1), 2^i)); bucket 0 is for frames without calls */
+    array<int, histogram_buckets> histogram;
+    };
+
+  struct trace_event {
+    int probe;
+    long long start, duration;
+    };
+
+  void finish(int p, std::chrono::steady_clock::time_point start);
+
+  struct scoped_timer {
+    int probe;
+    std::chrono::steady_clock::time_point start;
+    scoped_timer(int p) : probe(p), start(std::chrono::steady_clock::now()) {}
+    ~scoped_timer() { finish(probe, start); }
+    };
+#endif
+
+  EX array<probe_stats, max_probes> stats;
+
+  /** \brief record individual scopes for export_chrome_trace */
+  EX bool tracing = false;
+
+  /** \brief stop recording trace events after this many, to keep memory bounded */
+  EX int max_trace_events = 1000000;
+
+  EX vector<trace_event> trace;
+
+  EX int frames;
+
+  /** \brief whether a frame has been started, i.e., whether end_frame has something to close */
+  bool in_frame;
+
+  /** \brief files to export to; empty for none */
+  EX string json_fname, trace_fname;
+
+  /** \brief if positive, export (and stop profiling) after this many frames */
+  EX int export_frames;
+
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+  EX string probe_name(int p) {
+    switch(p) {
+      case dpOptimizeview: return "optimizeview";
+      case dpCenterpc: return "centerpc";
+      case dpDrawAll: return "draw_all";
+      case dpDoDraw: return "do_draw";
+      case dpInSmartRange: return "in_smart_range";
+      case dpDrawBoundary: return "draw_boundary";
+      case dpLimitedGeneration: return "limited_generation";
+      case dpCellsDrawn: return "cells_drawn";
+      case dpCellsGenerated: return "cells_generated";
+      }
+    int md = p - dpApplymodel;
+    if(md >= 0 && md < isize(mdinf)) return string("applymodel:") + mdinf[md].name_hyperbolic;
+    return "probe" + its(p);
+    }
+
+  bool is_counter(int p) { return p == dpCellsDrawn || p == dpCellsGenerated; }
+
+  EX void count(int p) {
+    if(p < 0 || p >= max_probes) return;
+    stats[p].calls++;
+    }
+
+  /** \brief for counters which are kept elsewhere: set the value for the current frame */
+  EX void set_value(int p, long long v) {
+    if(p < 0 || p >= max_probes) return;
+    stats[p].calls = v;
+    }
+
+  EX void finish(int p, std::chrono::steady_clock::time_point start) {
+    if(p < 0 || p >= max_probes) return;
+    auto now = std::chrono::steady_clock::now();
+    long long d = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+    auto& s = stats[p];
+    s.calls++;
+    s.nanos += d;
+    if(tracing && isize(trace) < max_trace_events) {
+      long long st = std::chrono::duration_cast<std::chrono::nanoseconds>(start - epoch).count();
+      trace.push_back(trace_event{p, st, d});
+      }
+    }
+
+  int bucket_of(long long x) {
+    int b = 1;
+    while(x && b < histogram_buckets-1) x >>= 1, b++;
+    return b;
+    }
+
+  void export_all();
+
+  /** \brief close the current frame: move the per-frame numbers into the histograms */
+  EX void end_frame() {
+    for(int p=0; p<max_probes; p++) {
+      auto& s = stats[p];
+      s.histogram[!s.calls ? 0 : bucket_of(is_counter(p) ? s.calls : s.nanos / 1000)]++;
+      s.total_calls += s.calls;
+      s.total_nanos += s.nanos;
+      s.calls = 0;
+      s.nanos = 0;
+      }
+    frames++;
+    if(export_frames && frames == export_frames) export_all();
+    }
+
+  /** \brief called when drawing of a frame starts; ends the previous frame, if any */
+  EX void start_frame() {
+    if(in_frame) end_frame();
+    in_frame = true;
+    }
+
+  EX void reset() {
+    for(auto& s: stats) s = probe_stats();
+    trace.clear();
+    frames = 0;
+    epoch = std::chrono::steady_clock::now();
+    }
+
+  /** \brief export totals and histograms of all probes which have been called */
+  EX void export_json(const string& fname) {
+    fhstream f(fname, "wt");
+    println(f, "{\"frames\": ", frames, ", \"bucket_unit\": \"log2 microseconds\", \"probes\": [");
+    bool first = true;
+    for(int p=0; p<max_probes; p++) {
+      auto& s = stats[p];
+      if(!s.total_calls) continue;
+      if(!first) println(f, ",");
+      first = false;
+      print(f, "  {\"name\": \"", probe_name(p), "\", \"calls\": ", s.total_calls, ", \"nanos\": ", s.total_nanos, ", \"histogram\": [");
+      for(int i=0; i<histogram_buckets; i++) print(f, i ? ", " : "", s.histogram[i]);
+      print(f, "]}");
+      }
+    println(f, "\n  ]}");
+    }
+
+  /** \brief export the recorded scopes as complete ("X") events in the Chrome trace format */
+  EX void export_chrome_trace(const string& fname) {
+    fhstream f(fname, "wt");
+    println(f, "{\"traceEvents\": [");
+    for(int i=0; i<isize(trace); i++) {
+      auto& e = trace[i];
+      print(f, "  {\"name\": \"", probe_name(e.probe), "\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, ",
+        "\"ts\": ", e.start / 1000., ", \"dur\": ", e.duration / 1000., "}");
+      println(f, i == isize(trace)-1 ? "" : ",");
+      }
+    println(f, "  ], \"displayTimeUnit\": \"ns\"}");
+    }
+
+  /** \brief write the files requested with -drawprof-json and -drawprof-trace */
+  void export_all() {
+    if(json_fname != "") export_json(json_fname), json_fname = "";
+    if(trace_fname != "") export_chrome_trace(trace_fname), trace_fname = "";
+    tracing = false;
+    }
+
+  #if CAP_COMMANDLINE
+  int read_args() {
+    using namespace arg;
+    if(argis("-drawprof-json")) {
+      shift(); json_fname = args();
+      }
+    else if(argis("-drawprof-trace")) {
+      shift(); trace_fname = args();
+      tracing = true;
+      }
+    else if(argis("-drawprof-frames")) {
+      shift(); export_frames = argi();
+      }
+    else return 1;
+    static bool registered = false;
+    if(!registered) registered = true, atexit(export_all);
+    return 0;
+    }
+
+  auto ah = addHook(hooks_args, 100, read_args);
+  #endif
+
+  EX }
+#endif
+
+}
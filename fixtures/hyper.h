@@ -16,8 +16,42 @@
 #define VER "12.1h"
 #define VERNUM_HEX 0xA928
 
+/** \brief build for a single geometry and variation, making the geometry macros compile-time constants
+ *
+ *  The profile is given by FIXED_GEOMETRY, FIXED_VARIATION, FIXED_S7, FIXED_S3, FIXED_CLASS, FIXED_FLAGS
+ *  and FIXED_DIM (the dimension of gameplay and graphics), and has to agree with ginf[FIXED_GEOMETRY]
+ *  (this is checked when the game starts). The default profile is bitruncated {7,3}. MAXMDIM and
+ *  CAP_MDIM_FIXED are set here, before sysconfig.h, to FIXED_DIM+1 and 1; setting them otherwise is an
+ *  error. The FPP mode in 2D geometries is not available.
+ */
+#ifndef CAP_FIXED_GEOMETRY
+#define CAP_FIXED_GEOMETRY 0
+#endif
+
+#if CAP_FIXED_GEOMETRY
+#ifndef FIXED_GEOMETRY
+#define FIXED_GEOMETRY gNormal
+#define FIXED_VARIATION eVariation::bitruncated
+#define FIXED_S7 7
+#define FIXED_S3 3
+#define FIXED_CLASS gcHyperbolic
+#define FIXED_FLAGS 0
+#define FIXED_DIM 2
+#endif
+#ifndef MAXMDIM
+#define MAXMDIM (FIXED_DIM+1)
+#endif
+#ifndef CAP_MDIM_FIXED
+#define CAP_MDIM_FIXED 1
+#endif
+#endif
+
 #include "sysconfig.h"
 
+#if CAP_FIXED_GEOMETRY && (MAXMDIM != FIXED_DIM+1 || !CAP_MDIM_FIXED)
+#error "CAP_FIXED_GEOMETRY requires MAXMDIM == FIXED_DIM+1 and CAP_MDIM_FIXED"
+#endif
+
 #include <stdarg.h>
 #include "hyper_function.h"
 
@@ -45,9 +79,9 @@ namespace hr
 
   /** \brief Is the value of first parameter equal to one of the remaining parameters? */
   template <class T, class V, class... U>
-  bool among(T x, V y) { return x == y; }
+  constexpr bool among(T x, V y) { return x == y; }
   template <class T, class V, class... U>
-  bool among(T x, V y, U... u) { return x == y || among(x, u...); }
+  constexpr bool among(T x, V y, U... u) { return x == y || among(x, u...); }
 
   // functions and types used from the standard library
   using std::array;
@@ -130,16 +164,35 @@ namespace hr
 
   // geometry-dependent constants
 
+/** \brief read the geometry macros (S7, hyperbolic, GDIM, ...) from the resolved active_geometry block, see hyperpoint.cpp */
+#ifndef CAP_ACTIVE_GEOMETRY
+#define CAP_ACTIVE_GEOMETRY 0
+#endif
+
 #define cginf ginf[geometry]
 
+#if CAP_FIXED_GEOMETRY
+#define S7 (FIXED_S7)
+#define S3 (FIXED_S3)
+#elif CAP_ACTIVE_GEOMETRY
+#define S7 (cgag().sides)
+#define S3 (cgag().vertex)
+#else
 #define S7 cginf.sides
 #define S3 cginf.vertex
+#endif
 #define hyperbolic_37 (S7 == 7 && S3 == 3 && !bt::in() && !arcm::in())
 #define hyperbolic_not37 ((S7 > 7 || S3 > 3 || bt::in() || arcm::in()) && hyperbolic)
 #define weirdhyperbolic ((S7 > 7 || S3 > 3 || !STDVAR || bt::in() || arcm::in() || arb::in()) && hyperbolic)
 #define stdhyperbolic (S7 == 7 && S3 == 3 && STDVAR && !bt::in() && !arcm::in() && !arb::in())
 
+#if CAP_FIXED_GEOMETRY
+#define cgflags (flagtype(FIXED_FLAGS))
+#elif CAP_ACTIVE_GEOMETRY
+#define cgflags (cgag().flags)
+#else
 #define cgflags cginf.flags
+#endif
 
 #define cryst (cgflags & qCRYSTAL)
 
@@ -149,16 +202,32 @@ namespace hr
 // these geometries do not feature alternate structures for horocycles
 #define eubinary (euclid || bt::in() || cryst || nil)
 
+#if CAP_ACTIVE_GEOMETRY && !CAP_FIXED_GEOMETRY
+#define cgclass (cgag().kind)
+#define euclid (cgag().is_euclid)
+#define sphere (cgag().is_sphere)
+#define sol (cgag().is_sol)
+#define nih (cgag().is_nih)
+#define nil (cgag().is_nil)
+#define sl2 (cgag().is_sl2)
+#define hyperbolic (cgag().is_hyperbolic)
+#define nonisotropic (cgag().is_nonisotropic)
+#else
+#if CAP_FIXED_GEOMETRY
+#define cgclass (FIXED_CLASS)
+#else
 #define cgclass (cginf.cclass)
+#endif
 #define euclid (cgclass == gcEuclid)
 #define sphere (cgclass == gcSphere)
 #define sol (among(cgclass, gcSol, gcSolN))
 #define nih (among(cgclass, gcNIH, gcSolN))
 #define nil (cgclass == gcNil)
 #define sl2 (cgclass == gcSL2)
-#define rotspace (geometry == gRotSpace)
 #define hyperbolic (cgclass == gcHyperbolic)
 #define nonisotropic (among(cgclass, gcSol, gcSolN, gcNIH, gcSL2, gcNil))
+#endif
+#define rotspace (geometry == gRotSpace)
 #define translatable (euclid || nonisotropic)
 #define nonorientable (cgflags & qNONORIENTABLE)
 #define elliptic (cgflags & qELLIPTIC)
@@ -206,22 +275,32 @@ namespace hr
 
 #define GOLDBERG_INV (GOLDBERG || INVERSE)
 
-#define INVERSE among(variation, eVariation::unrectified, eVariation::warped, eVariation::untruncated)
+#if CAP_FIXED_GEOMETRY
+#define cgvariation (FIXED_VARIATION)
+#else
+#define cgvariation variation
+#endif
+
+#define INVERSE among(cgvariation, eVariation::unrectified, eVariation::warped, eVariation::untruncated)
 
-#define UNRECTIFIED (variation == eVariation::unrectified)
-#define WARPED (variation == eVariation::warped)
-#define UNTRUNCATED (variation == eVariation::untruncated)
+#define UNRECTIFIED (cgvariation == eVariation::unrectified)
+#define WARPED (cgvariation == eVariation::warped)
+#define UNTRUNCATED (cgvariation == eVariation::untruncated)
 
-#define GOLDBERG (variation == eVariation::goldberg)
-#define IRREGULAR (variation == eVariation::irregular)
-#define PURE (variation == eVariation::pure)
-#define BITRUNCATED (variation == eVariation::bitruncated)
-#define DUAL (variation == eVariation::dual)
+#define GOLDBERG (cgvariation == eVariation::goldberg)
+#define IRREGULAR (cgvariation == eVariation::irregular)
+#define PURE (cgvariation == eVariation::pure)
+#define BITRUNCATED (cgvariation == eVariation::bitruncated)
+#define DUAL (cgvariation == eVariation::dual)
 #define DUALMUL (DUAL ? 2 : 1)
 
 #define CHANGED_VARIATION (variation != cginf.default_variation)
 
+#if CAP_ACTIVE_GEOMETRY && !CAP_FIXED_GEOMETRY
+#define STDVAR (cgag().is_stdvar)
+#else
 #define STDVAR (PURE || BITRUNCATED)
+#endif
 #define NONSTDVAR (!STDVAR)
 
 #define VALENCE current_valence()
@@ -470,12 +549,22 @@ namespace hr
 
   extern videopar vid;
 
+#if CAP_FIXED_GEOMETRY
+#define WDIM (FIXED_DIM)
+#define GDIM (FIXED_DIM)
+#define MDIM (MAXMDIM)
+#elif CAP_ACTIVE_GEOMETRY
+#define WDIM (cgag().gameplay_dimension)
+#define GDIM (cgag().graphical_dimension)
+#define MDIM (MAXMDIM == 3 ? 3 : cgag().homogeneous_dimension)
+#else
 /** \brief How many dimensional is the gameplay. In the FPP mode of a 2D geometry, WDIM is 2 */
 #define WDIM cginf.g.gameplay_dimension
 /** \brief How many dimensional is the graphical representation. In the FPP mode of a 2D geometry, MDIM is 3 */
 #define GDIM cginf.g.graphical_dimension
 /** \brief How many dimensions of the matrix representation are used. It is usually 3 in 2D geometries (not FPP) and in product geometries, 4 in 3D geometries */
 #define MDIM (MAXMDIM == 3 ? 3 : cginf.g.homogeneous_dimension)
+#endif
 /** \brief What dimension of matrices is used in loops (the 'extra' dimensions have values 0 or 1 as in Id)
  *  Even if MDIM==3, it may be faster to keep 4x4 matrices and perform computations using them (rather than having another condition due to the variable loop size).
  *  The experiments on my computer show it to be the case, but the effect is not significant, and it may be different on another computer.
@@ -554,36 +643,115 @@ namespace hr
 
   // shmup
 
+  /** \brief a set of hooks, called in the order of priority
+   *
+   *  Hooks are kept in a contiguous array sorted by priority. The array is never modified in place:
+   *  add() and del() (serialized by a mutex) build a new copy and publish its pointer atomically,
+   *  so callhooks() and callhandlers() just load the pointer and iterate, without locking, even if
+   *  hooks are added or removed concurrently or by the hooks themselves. A replaced array is
+   *  retired, and freed once no callhooks() or callhandlers() is running on this hookset, since
+   *  only those could still be iterating it. The current one is never freed, so hooks still work
+   *  during static destruction.
+   */
   template <class T>
   class hookset
   {
-    std::map<int, std::function<T>> *map_ = nullptr;
+    typedef vector<pair<int, std::function<T>>> hooklist;
+    struct version
+    {
+      hooklist hooks;
+      version *retired_next;
+    };
+
+    /* all of these are constant-initialized, so hooks can be added from static initializers in any order */
+    std::atomic<version *> list_{nullptr};
+    mutable std::atomic<int> readers_{0};
+    mutable std::atomic<bool> pending_{false};
+    mutable std::mutex lock_;
+    mutable version *retired_ = nullptr;
+
+    /** \brief free the retired versions if no reader is active; lock_ must be held */
+    void reclaim() const
+    {
+      if (readers_.load() == 0)
+        while (retired_)
+        {
+          version *v = retired_;
+          retired_ = v->retired_next;
+          delete v;
+        }
+      pending_ = retired_ != nullptr;
+    }
+
+    /** \brief a reader epoch: the versions retired while any of these exist are not freed */
+    struct reader_scope
+    {
+      const hookset &h;
+      explicit reader_scope(const hookset &h) : h(h) { h.readers_++; }
+      ~reader_scope()
+      {
+        if (--h.readers_ == 0 && h.pending_ && h.lock_.try_lock())
+        {
+          h.reclaim();
+          h.lock_.unlock();
+        }
+      }
+    };
+
+    /** \brief replace the list by f(copy of the list) */
+    template <class F>
+    void update(const F &f)
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      version *old = list_.load();
+      version *next = new version{old ? old->hooks : hooklist(), nullptr};
+      f(next->hooks);
+      list_.store(next);
+      if (old)
+        old->retired_next = retired_, retired_ = old;
+      reclaim();
+    }
 
   public:
     template <class U>
     int add(int prio, U &&hook)
     {
-      if (map_ == nullptr)
-        map_ = new std::map<int, std::function<T>>();
-      while (map_->count(prio))
+      std::function<T> fun(static_cast<U &&>(hook));
+      int res;
+      update([&](hooklist &l)
       {
-        prio++;
-      }
-      map_->emplace(prio, static_cast<U &&>(hook));
-      return prio;
+        res = prio;
+        auto it = l.begin();
+        while (it != l.end() && it->first < res)
+          it++;
+        while (it != l.end() && it->first == res)
+          it++, res++;
+        l.emplace(it, res, fun);
+      });
+      return res;
     }
 
     void del(int prio)
     {
-      map_->erase(prio);
+      update([&](hooklist &l)
+      {
+        for (auto it = l.begin(); it != l.end(); it++)
+          if (it->first == prio)
+          {
+            l.erase(it);
+            return;
+          }
+      });
     }
 
     template <class... U>
     void callhooks(U &&...args) const
     {
-      if (map_ == nullptr)
+      reader_scope rs(*this);
+      const version *l = list_.load();
+      if (l == nullptr)
         return;
-      for (const auto &p : *map_)
+      for (const auto &p : l->hooks)
       {
         p.second(static_cast<U &&>(args)...);
       }
@@ -592,9 +760,11 @@ namespace hr
     template <class V, class... U>
     V callhandlers(V zero, U &&...args) const
     {
-      if (map_ == nullptr)
+      reader_scope rs(*this);
+      const version *l = list_.load();
+      if (l == nullptr)
         return zero;
-      for (const auto &p : *map_)
+      for (const auto &p : l->hooks)
       {
         auto z = p.second(static_cast<U &&>(args)...);
         if (z != zero)
@@ -640,7 +810,7 @@ namespace hr
 
 #define GUNRANGE 3
 
-  // loops
+  // loops -- see also adj_cm, adj_ex, adj_nocreate and neighbor_records in locations.cpp, which work with range-for
 
 #define fakecellloop(ct) for (cell *ct = (cell *)1; ct; ct = NULL)
 
@@ -735,6 +905,11 @@ namespace hr
 
 #define CAP_MENUSCALING (ISPANDORA || ISMOBILE)
 
+/** \brief timers and counters of the drawing pipeline, see drawprof.cpp */
+#ifndef CAP_DRAWPROF
+#define CAP_DRAWPROF 0
+#endif
+
 #if CAP_MENUSCALING
 #define displayfrZ dialog::zoom::displayfr
 #define displayfrZH dialog::zoom::displayfr_highlight
@@ -1007,14 +1182,142 @@ namespace hr
 
 #define BEHIND_LIMIT 1e-6
 
-  template <class T, class U>
-  void eliminate_if(vector<T> &data, U pred)
+  /** \brief remove the elements satisfying pred (changing the order); works for vector and small_vector */
+  template <class V, class U>
+  void eliminate_if(V &data, U pred)
   {
     for (int i = 0; i < isize(data); i++)
       if (pred(data[i]))
         data[i] = data.back(), data.pop_back(), i--;
   }
 
+  /** \brief a bump allocator for transient data
+   *
+   *  Memory is never freed individually: release() returns to a mark, and reset() makes the whole
+   *  arena available again, reusing the blocks which have been allocated so far.
+   */
+  struct query_arena
+  {
+    static const size_t BLOCK = 1 << 16;
+    vector<pair<char *, size_t>> blocks;
+    int current = 0;
+    size_t used = 0;
+
+    query_arena() {}
+    query_arena(const query_arena &) = delete;
+    ~query_arena()
+    {
+      for (auto &b : blocks)
+        delete[] b.first;
+    }
+
+    void *allocate(size_t bytes, size_t align)
+    {
+      while (true)
+      {
+        if (current == isize(blocks))
+        {
+          size_t size = bytes + align > BLOCK ? bytes + align : BLOCK;
+          blocks.emplace_back(new char[size], size);
+        }
+        size_t at = (used + align - 1) & ~(align - 1);
+        if (at + bytes <= blocks[current].second)
+        {
+          used = at + bytes;
+          return blocks[current].first + at;
+        }
+        current++;
+        used = 0;
+      }
+    }
+
+    pair<int, size_t> mark() const { return make_pair(current, used); }
+    void release(pair<int, size_t> m) { current = m.first, used = m.second; }
+    void reset() { current = 0, used = 0; }
+  };
+
+  /** \brief a query_arena for the transient data of queries in the current thread; use it with arena_scope */
+  inline query_arena &scratch_arena()
+  {
+    static thread_local query_arena a;
+    return a;
+  }
+
+  /** \brief release everything allocated from the arena during the lifetime of this object */
+  struct arena_scope
+  {
+    query_arena &arena;
+    pair<int, size_t> saved;
+    explicit arena_scope(query_arena &a) : arena(a), saved(a.mark()) {}
+    ~arena_scope() { arena.release(saved); }
+  };
+
+  /** \brief a vector of trivially copyable values, the first N of which are stored inline
+   *
+   *  It only allocates when it grows beyond N elements; the memory then comes from the given
+   *  query_arena, or from the heap if there is none.
+   */
+  template <class T, int N>
+  struct small_vector
+  {
+    static_assert(std::is_trivially_copyable<T>::value, "small_vector requires trivially copyable elements");
+    T *b;
+    int n, cap;
+    query_arena *arena;
+    alignas(T) unsigned char local[N * sizeof(T)];
+
+    explicit small_vector(query_arena *a = nullptr) : b((T *)local), n(0), cap(N), arena(a) {}
+    small_vector(const small_vector &) = delete;
+    small_vector &operator=(const small_vector &) = delete;
+    ~small_vector()
+    {
+      if (on_heap())
+        ::operator delete(b);
+    }
+
+    bool on_heap() const { return b != (T *)local && !arena; }
+
+    void reserve(int c)
+    {
+      if (c <= cap)
+        return;
+      T *nb = (T *)(arena ? arena->allocate(c * sizeof(T), alignof(T)) : ::operator new(c * sizeof(T)));
+      memcpy(nb, b, n * sizeof(T));
+      if (on_heap())
+        ::operator delete(b);
+      b = nb;
+      cap = c;
+    }
+
+    void push_back(const T &x)
+    {
+      T y = x;
+      if (n == cap)
+        reserve(2 * cap);
+      b[n++] = y;
+    }
+
+    void resize(int k)
+    {
+      reserve(k);
+      for (int i = n; i < k; i++)
+        b[i] = T();
+      n = k;
+    }
+
+    void pop_back() { n--; }
+    void clear() { n = 0; }
+    size_t size() const { return n; }
+    bool empty() const { return !n; }
+    T &back() { return b[n - 1]; }
+    T &operator[](int i) { return b[i]; }
+    const T &operator[](int i) const { return b[i]; }
+    T *begin() { return b; }
+    T *end() { return b + n; }
+    const T *begin() const { return b; }
+    const T *end() const { return b + n; }
+  };
+
   template <class T>
   array<T, 4> make_array(T a, T b, T c, T d)
   {
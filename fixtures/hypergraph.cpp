@@ -283,6 +283,89 @@ EX void makeband_f(shiftpoint H, hyperpoint& ret, const hr::function<void(ld&,ld
   makeband(H, ret, f);
   }
 
+/** \brief maximum screen-space deviation (in pixels) tolerated by adaptive_band_edge */
+EX ld band_tessellation_tolerance = 0.5;
+
+/** \brief maximum recursion depth of adaptive_band_edge, i.e., at most 2^depth segments per edge */
+EX int band_tessellation_depth = 10;
+
+/** \brief a segment still longer than this (in pixels) at the maximum depth is assumed to cross the seam of the band */
+EX ld band_seam_gap = 16;
+
+bool band_finite(const hyperpoint& p) {
+  return std::isfinite(p[0]) && std::isfinite(p[1]);
+  }
+
+ld band_pixels(ld dx, ld dy) {
+  dx *= current_display->radius;
+  dy *= current_display->radius * pconf.stretch;
+  return dx*dx + dy*dy;
+  }
+
+/** \brief start a new piece, unless the current one is still empty */
+void band_break(vector<vector<hyperpoint>>& out) {
+  if(out.empty() || !out.back().empty()) out.emplace_back();
+  }
+
+/** the subdivision only follows the seam along the half which contains it, so a seam-crossing edge
+ *  costs O(depth) rather than O(2^depth) */
+void adaptive_band_rec(const shiftpoint& h1, const hyperpoint& p1, const shiftpoint& h2, const hyperpoint& p2, vector<vector<hyperpoint>>& out, int depth) {
+  if(depth <= 0) {
+    if(band_pixels(p2[0] - p1[0], p2[1] - p1[1]) > band_seam_gap * band_seam_gap) band_break(out);
+    return;
+    }
+  shiftpoint hm = mid(h1, h2);
+  hyperpoint pm;
+  applymodel(hm, pm);
+  if(!band_finite(pm)) { band_break(out); return; }
+  if(band_pixels(pm[0] - (p1[0] + p2[0]) / 2, pm[1] - (p1[1] + p2[1]) / 2) <= band_tessellation_tolerance * band_tessellation_tolerance) return;
+  adaptive_band_rec(h1, p1, hm, pm, out, depth-1);
+  out.back().push_back(pm);
+  adaptive_band_rec(hm, pm, h2, p2, out, depth-1);
+  }
+
+/** \brief project the edge from h1 to h2 with the current model, appending the model coordinates to out.back()
+ *
+ *  Midpoints are only added where the projected midpoint deviates from the projected chord by more
+ *  than band_tessellation_tolerance pixels, so flat parts of the band stay coarse while the
+ *  strongly curved parts near the band edges get refined. Where the edge crosses the seam of the
+ *  band, or projects to an invalid point, a new piece is started in out instead of drawing a line
+ *  across the screen. The first vertex is skipped if include_first is false, which allows chaining
+ *  edges of a polyline.
+ */
+EX void adaptive_band_edge(const shiftpoint& h1, const shiftpoint& h2, vector<vector<hyperpoint>>& out, bool include_first IS(true)) {
+  hyperpoint p1, p2;
+  applymodel(h1, p1);
+  applymodel(h2, p2);
+  if(out.empty()) out.emplace_back();
+  if(!band_finite(p1) || !band_finite(p2)) {
+    band_break(out);
+    return;
+    }
+  if(include_first) out.back().push_back(p1);
+  adaptive_band_rec(h1, p1, h2, p2, out, band_tessellation_depth);
+  out.back().push_back(p2);
+  }
+
+/** \brief adaptive_band_edge applied to every edge of a polyline */
+EX void adaptive_band_polyline(const vector<shiftpoint>& pts, vector<vector<hyperpoint>>& out) {
+  for(int i=1; i<isize(pts); i++)
+    adaptive_band_edge(pts[i-1], pts[i], out, i == 1);
+  }
+
+/** \brief queue the polyline pts as lines, tessellated with adaptive_band_polyline */
+EX void queue_adaptive_band_polyline(const vector<shiftpoint>& pts, color_t col, PPR prio) {
+  vector<vector<hyperpoint>> pieces;
+  adaptive_band_polyline(pts, pieces);
+  queuereset(mdPixel, prio);
+  for(auto& piece: pieces) {
+    if(isize(piece) < 2) continue;
+    for(auto& h: piece) curvepoint(point3(h[0] * current_display->radius, h[1] * current_display->radius, 0));
+    queuecurve(shiftless(Id), col, 0, prio).flags |= POLY_FORCEWIDE;
+    }
+  queuereset(pmodel, prio);
+  }
+
 void band_conformal(ld& x, ld& y) {
   switch(cgclass) {
     case gcSphere:
@@ -397,6 +480,7 @@ EX void apply_nil_rotation(hyperpoint& H) {
   }
 
 EX void applymodel(shiftpoint H_orig, hyperpoint& ret) {
+  DRAWPROF_SCOPE(dpApplymodel + pmodel);
   apply_other_model(H_orig, ret, pmodel);
   }
 
@@ -468,12 +552,13 @@ EX void threepoint_projection(const hyperpoint& H, hyperpoint& ret) {
      After setting s = x^2+y^2+z^2, we get a system of linear equations for (x,y,s)
   */
 
-  dynamicval<eGeometry> g(geometry, gEuclid);
+  /* computed in the Euclidean plane, without changing the global geometry */
+  auto ctx = make_context(gEuclid, 3);
 
   transmatrix T = Id;
-  hyperpoint v = C0;
+  hyperpoint v = C02;
   for(int i=0; i<3; i++) {
-    hyperpoint pp = xspinpush0(TAU*i/3, p);
+    hyperpoint pp = xspinpush0(ctx, TAU*i/3, p);
     v[i] = dist[i]*dist[i] - p*p;
     T[i][0] = -2 * pp[0];
     T[i][1] = -2 * pp[1];
@@ -481,7 +566,8 @@ EX void threepoint_projection(const hyperpoint& H, hyperpoint& ret) {
     }
 
   transmatrix U = inverse3(T);
-  hyperpoint sxy = U * v;
+  hyperpoint sxy = Hypc;
+  for(int i=0; i<3; i++) for(int j=0; j<3; j++) sxy[i] += U[i][j] * v[j];
 
   // compute the actual z based on s
   sxy[2] = sxy[2] - sqhypot_d(2, sxy);
@@ -491,8 +577,6 @@ EX void threepoint_projection(const hyperpoint& H, hyperpoint& ret) {
 
   sxy[3] = 1;
 
-  geometry = gCubeTiling;
-
   ret = sxy;
   models::apply_orientation(ret[1], ret[0]);
   models::apply_orientation_yz(ret[2], ret[1]);
@@ -1613,6 +1697,7 @@ EX bool invalid_point(const hyperpoint h) {
 EX bool invalid_point(const shiftpoint h) { return invalid_point(h.h); }
 
 EX bool in_smart_range(const shiftmatrix& T) {
+  DRAWPROF_SCOPE(dpInSmartRange);
   shiftpoint h = tC0(T);
   if(invalid_point(h)) return false;
   if(nil || nih) return true;
@@ -1794,6 +1879,11 @@ EX bool drawcell_subs(cell *c, const shiftmatrix& V) {
   }
 
 void hrmap::draw_all() {
+  #if CAP_DRAWPROF
+  /* cells_drawn is reset once per frame, so further calls in the same frame (subscreens) do not start a new one */
+  if(!cells_drawn) drawprof::start_frame();
+  #endif
+  DRAWPROF_SCOPE(dpDrawAll);
   if(sphere && pmodel == mdSpiral) {
     if(models::ring_not_spiral) {
       int qty = ceil(1. / pconf.sphere_spiral_multiplier);
@@ -1813,6 +1903,7 @@ void hrmap::draw_all() {
     }
   else
     draw_at(centerover, cview());
+  DRAWPROF_VALUE(dpCellsDrawn, cells_drawn);
   }
 
 void hrmap::draw_at(cell *at, const shiftmatrix& where) {
@@ -1946,16 +2037,10 @@ EX void spinEdge(ld aspd) {
     V = cspin90(2, dir) * V;
 
     if(1) {
-      dynamicval<eGeometry> g(geometry, gSphere);
-      bool b = vid.always3;
-      vid.always3 = false;
-      geom3::apply_always3();
-      V = gpushxto0(V*C0) * V;
-      fixmatrix(V);
-      if(b) {
-        vid.always3 = b;
-        geom3::apply_always3();
-        }
+      /* in the 2D sphere, without changing the global geometry */
+      auto ctx = make_context(gSphere, 3);
+      V = gpushxto0(ctx, V*C02) * V;
+      fixmatrix(ctx, V);
       }
 
     vrhr::be_33(V);
@@ -2049,6 +2134,7 @@ EX bool shmup_inverted() {
   }
 
 EX void centerpc(ld aspd) {
+  DRAWPROF_SCOPE(dpCenterpc);
 
   if(subscreens::split([=] () {centerpc(aspd);})) return;
   if(dual::split([=] () { centerpc(aspd); })) return;
@@ -2163,6 +2249,7 @@ EX transmatrix oView;
 EX purehookset hooks_preoptimize, hooks_postoptimize;
 
 EX void optimizeview() {
+  DRAWPROF_SCOPE(dpOptimizeview);
 
   if(subscreens::split(optimizeview)) return;
   if(dual::split(optimizeview)) return;
@@ -2301,8 +2388,10 @@ transmatrix screenpos(ld x, ld y) {
 */
 
 EX int flat_on;
+#if !CAP_FIXED_GEOMETRY
 eGeometry backup_geometry;
 eVariation backup_variation;
+#endif
 videopar backup_vid;
 bool backup_lpu;
 
@@ -2312,12 +2401,15 @@ EX void enable_flat_model(int val) {
     #if CAP_GL
     glClear(GL_DEPTH_BUFFER_BIT);
     #endif
-    backup_geometry = geometry;
-    backup_variation = variation;
     backup_lpu = nisot::local_perspective_used;
     backup_vid = vid;
+    /* in a fixed-geometry build, the HUD is drawn in that geometry, in the disk model */
+    #if !CAP_FIXED_GEOMETRY
+    backup_geometry = geometry;
+    backup_variation = variation;
     geometry = gNormal;
     variation = eVariation::bitruncated;
+    #endif
     nisot::local_perspective_used = false;
 
     pmodel = mdDisk;
@@ -2332,16 +2424,20 @@ EX void enable_flat_model(int val) {
     vid.camera = 1;
     vid.depth = 1;
     geom3::apply_always3();
+    refresh_active_geometry();
     check_cgi();
     cgi.require_shapes();
     calcparam();
     }
   if(flat_on >= 1 && flat_on + val < 1) {
+    #if !CAP_FIXED_GEOMETRY
     geometry = backup_geometry;
     variation = backup_variation;
+    #endif
     nisot::local_perspective_used = backup_lpu;
     vid = backup_vid;
     geom3::apply_always3();
+    refresh_active_geometry();
     calcparam();
     check_cgi();
     }
@@ -2585,6 +2681,7 @@ void queuestraight(hyperpoint X, int style, color_t lc, color_t fc, PPR p) {
   }
 
 EX void draw_boundary(int w) {
+  DRAWPROF_SCOPE(dpDrawBoundary);
 
   if(w == 1) return;
   if(nonisotropic || euclid || gproduct) return;
@@ -2673,14 +2770,12 @@ EX void draw_boundary(int w) {
         }
       if(sphere && bndband) {
         ld adegree = degree-1e-6;
-        for(ld a=-90; a<90+1e-6; a+=pow(.5, vid.linequality)) {
-          curvepoint(T * xpush(xperiod) * ypush0(a * adegree));
-          }
-        for(ld a=-90; a<90+1e-6; a+=pow(.5, vid.linequality)) {
-          curvepoint(T * xpush(-xperiod) * ypush0(-a * adegree));
-          }
-        curvepoint(T * xpush(xperiod) * ypush0(-90 * adegree));
-        queuecurve(shiftless(Id), periodcolor, 0, PPR::CIRCLE).flags |= POLY_FORCEWIDE;
+        /* only band-family models get here, so the period lines are tessellated adaptively */
+        vector<shiftpoint> pts;
+        for(int a=-90; a<=90; a+=15) pts.push_back(shiftless(T * xpush(xperiod) * ypush0(a * adegree)));
+        for(int a=-90; a<=90; a+=15) pts.push_back(shiftless(T * xpush(-xperiod) * ypush0(-a * adegree)));
+        pts.push_back(pts[0]);
+        queue_adaptive_band_polyline(pts, periodcolor, PPR::CIRCLE);
         }
       return;
       }
@@ -2963,11 +3058,189 @@ EX namespace dq {
     visited_c.clear();
     while(!drawqueue_c.empty()) drawqueue_c.pop();
     while(!drawqueue.empty()) drawqueue.pop();
+    hcull::clear();
     }
 
 
   EX }
 
+/** \brief hierarchical culling for 3D views
+ *
+ *  Cells are grouped by their master heptagon. Each heptagon gets a conservative bounding radius
+ *  (the farthest corner of any of its cells, measured from the heptagon center), so a whole group
+ *  of cells can be rejected by a single test against the sight range, the view cone, and
+ *  pconf.clip_min/clip_max. With the smart range, only the tests which in_smart_range would fail
+ *  for every cell of the heptagon are used. The result is cached per heptagon until the next
+ *  dq::clear_all.
+ */
+EX namespace hcull {
+  EX bool on = true;
+
+  #if HDR
+  enum eCull : signed char { cUnknown, cOutside, cPartial };
+  #endif
+
+  /** \brief open addressing table of results; entries from older frames are recognized by their stamp */
+  struct cull_entry {
+    heptagon *h;
+    unsigned stamp;
+    eCull st;
+    };
+
+  vector<cull_entry> table;
+  unsigned stamp = 1;
+  int used;
+
+  /** \brief the geometry for which radius has been computed */
+  geometry_information *radius_for;
+
+  /** \brief the bounding radius of a heptagon, or -1 if it could not be determined */
+  EX ld radius;
+
+  EX void clear() {
+    used = 0;
+    if(!++stamp) {
+      for(auto& e: table) e.stamp = 0;
+      stamp = 1;
+      }
+    }
+
+  int slot(heptagon *h, int mask) {
+    return int(((size_t) h >> 4) * 0x9E3779B97F4A7C15ull >> 20) & mask;
+    }
+
+  eCull& find(heptagon *h) {
+    if(2 * (used + 1) > isize(table)) {
+      vector<cull_entry> old;
+      swap(old, table);
+      table.resize(max(1024, 2 * isize(old)), cull_entry{nullptr, 0, cUnknown});
+      int mask = isize(table) - 1;
+      for(auto& e: old) if(e.stamp == stamp) {
+        int i = slot(e.h, mask);
+        while(table[i].stamp == stamp) i = (i+1) & mask;
+        table[i] = e;
+        }
+      }
+    int mask = isize(table) - 1;
+    int i = slot(h, mask);
+    while(table[i].stamp == stamp) {
+      if(table[i].h == h) return table[i].st;
+      i = (i+1) & mask;
+      }
+    used++;
+    table[i] = cull_entry{h, stamp, cUnknown};
+    return table[i].st;
+    }
+
+  EX bool available() {
+    if(!on || WDIM != 3) return false;
+    if(!(hyperbolic || euclid) || nonisotropic || gproduct || quotient || confusingGeometry()) return false;
+    return true;
+    }
+
+  void compute_radius() {
+    radius_for = cgip;
+    heptagon *h = currentmap->getOrigin();
+    cell *c0 = h->c7;
+    vector<cell*> v = {c0};
+    set<cell*> seen = {c0};
+    ld r = 0;
+    for(int i=0; i<isize(v); i++) {
+      cell *c = v[i];
+      transmatrix M = currentmap->master_relative(c, false);
+      /* master_relative not implemented for this map, so cells cannot be located relative to their heptagon */
+      if(c != c0 && eqmatrix(M, Id)) { radius = -1; return; }
+      r = max(r, hdist0(tC0(M)));
+      for(int j=0; j<c->type; j++) {
+        cell *c1 = c->cmove(j);
+        if(c1->master == h && !seen.count(c1)) seen.insert(c1), v.push_back(c1);
+        }
+      }
+    radius = r + cgi.corner_bonus;
+    }
+
+  /** \brief the projected center, and how far the projection of the bounding ball extends from it */
+  bool project_ball(const shiftmatrix& Th, ld r, hyperpoint& h1, ld& dx, ld& dy, ld& dz) {
+    applymodel(tC0(Th), h1);
+    if(invalid_point(h1)) return false;
+    dx = dy = dz = 0;
+    for(int i=0; i<3; i++) for(int sgn: {-1, 1}) {
+      hyperpoint h2;
+      applymodel(Th * cpush0(i, sgn * r), h2);
+      if(invalid_point(h2)) return false;
+      dx = max(dx, abs(h2[0] - h1[0]));
+      dy = max(dy, abs(h2[1] - h1[1]));
+      dz = max(dz, abs(h2[2] - h1[2]));
+      }
+    return true;
+    }
+
+  /** \brief the tests of in_smart_range which do not depend on the size of the cell, applied to the whole ball */
+  eCull test_smart(const shiftmatrix& Th, ld r) {
+    if(in_perspective() || geom3::euc_in_hyp()) return cPartial;
+    hyperpoint h1;
+    ld dx, dy, dz;
+    if(!project_ball(Th, r, h1, dx, dy, dz)) return cPartial;
+    ld x = current_display->xcenter + current_display->radius * h1[0];
+    ld y = current_display->ycenter + current_display->radius * h1[1] * pconf.stretch;
+    /* the projection is not linear, so the extents are doubled, as in in_smart_range */
+    ld mx = 2 * current_display->radius * dx;
+    ld my = 2 * current_display->radius * dy * abs(pconf.stretch);
+    if(x - mx > current_display->xtop + current_display->xsize * 2) return cOutside;
+    if(x + mx < current_display->xtop - current_display->xsize * 1) return cOutside;
+    if(y - my > current_display->ytop + current_display->ysize * 2) return cOutside;
+    if(y + my < current_display->ytop - current_display->ysize * 1) return cOutside;
+    if(GDIM == 3) {
+      if(-h1[2] + 2 * dz < pconf.clip_min * 2 - pconf.clip_max) return cOutside;
+      if(-h1[2] - 2 * dz > pconf.clip_max * 2 - pconf.clip_min) return cOutside;
+      }
+    return cPartial;
+    }
+
+  eCull test_heptagon(cell *c, const shiftmatrix& T) {
+    shiftmatrix Th = T * currentmap->master_relative(c, true);
+    ld r = radius;
+    if(vid.use_smart_range) return test_smart(Th, r);
+
+    hyperpoint h = inverse_exp(tC0(Th), pQUICK);
+    ld d = hypot_d(3, h);
+
+    if(d - r > sightranges[geometry]) return cOutside;
+
+    /* the camera may be inside, or too close to tell */
+    ld margin = 2 * cgi.corner_bonus;
+    if(d <= r + margin) return cPartial;
+
+    if(in_perspective()) {
+      h = lp_apply(h);
+      /* half-angle of a cone containing the whole view frustum */
+      ld cone = atan(current_display->tanfov * hypot(1, vid.yres * 1. / vid.xres));
+      /* angular radius of the bounding ball, extended by a cell so that the BFS can still pass around it */
+      ld alpha = asin_auto(min<ld>(sin_auto(r + margin) / sin_auto(d), 1));
+      ld theta = acos(max<ld>(-1, min<ld>(1, h[2] / d)));
+      if(cone + alpha < 90._deg && theta - alpha > cone) return cOutside;
+      }
+    else if(GDIM == 3) {
+      hyperpoint h1;
+      ld dx, dy, dz;
+      if(!project_ball(Th, r, h1, dx, dy, dz)) return cPartial;
+      if(-h1[2] + 2 * dz < pconf.clip_min || -h1[2] - 2 * dz > pconf.clip_max) return cOutside;
+      }
+
+    return cPartial;
+    }
+
+  /** \brief returns cOutside if the heptagon of c, with all its cells, is certainly not visible */
+  EX eCull test(cell *c, const shiftmatrix& T) {
+    if(!available()) return cPartial;
+    if(radius_for != cgip) compute_radius();
+    if(radius < 0) return cPartial;
+    auto& st = find(c->master);
+    if(st == cUnknown) st = test_heptagon(c, T);
+    return st;
+    }
+  EX }
+
 EX bool do_draw(cell *c) {
   // do not display out of range cells, unless on torus
   if(c->pathdist == PINFD && !(meuclid && quotient) && vid.use_smart_range == 0)
@@ -2984,16 +3257,19 @@ EX ld extra_generation_distance = 99;
 
 // returns false if limited
 bool limited_generation(cell *c) {
+  DRAWPROF_SCOPE(dpLimitedGeneration);
   if(c->mpdist <= 7) return true;
   if(cells_generated > vid.cells_generated_limit) return false;
   setdist(c, 7, c);
   cells_generated++;
+  DRAWPROF_COUNT(dpCellsGenerated);
   return true;
   }
 
 EX int min_cells_drawn = 50;
 
 EX bool do_draw(cell *c, const shiftmatrix& T) {
+  DRAWPROF_SCOPE(dpDoDraw);
 
   if(WDIM == 3) {
     // do not care about cells outside of the track
@@ -3025,10 +3301,12 @@ EX bool do_draw(cell *c, const shiftmatrix& T) {
       }
     #endif
     else if(vid.use_smart_range) {
+      if(cells_drawn >= min_cells_drawn && hcull::test(c, T) == hcull::cOutside) return false;
       if(cells_drawn >= min_cells_drawn && !in_smart_range(T)) return false;
       if(!limited_generation(c)) return false;
       }
     else {
+      if(hcull::test(c, T) == hcull::cOutside) return false;
       ld dist = hdist0(tC0(T.T));
       if(dist > sightranges[geometry] + (vid.sloppy_3d ? 0 : cgi.corner_bonus)) return false;
       if(dist <= extra_generation_distance && !limited_generation(c)) return false;
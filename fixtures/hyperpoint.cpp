@@ -27,8 +27,123 @@ static const ld log_golden_phi = log(golden_phi);
 constexpr ld operator"" _deg(long double deg) { return deg * A_PI / 180; }
 #endif
 
+/* code which needs to compute in another geometry, or in another thread, passes a geometry_context instead of modifying these */
+#if CAP_FIXED_GEOMETRY
+const eGeometry geometry = FIXED_GEOMETRY;
+const eVariation variation = FIXED_VARIATION;
+#else
 eGeometry geometry;
 eVariation variation;
+#endif
+
+#if HDR
+/** \brief the geometry settings the isotropic math core depends on, passed explicitly
+ *
+ *  The functions which take a geometry_context (sig, curvature, sin_auto, cos_auto, cpush,
+ *  xspinpush0, ggpushxto0, gpushxto0, rgpushxto0, orthonormalize, fixmatrix) compute in the geometry
+ *  it describes, rather than in the global one, and do not modify any globals. So they can be used
+ *  instead of a dynamicval on geometry, and concurrently by several threads, or for several viewports,
+ *  each with its own context. They are the implementation: the global versions handle the special
+ *  cases (product, nonisotropic and embedded geometries) and call them with current_context().
+ *  The context is a value: get it with current_context() or make_context() on the main thread, and
+ *  pass it along.
+ */
+struct geometry_context {
+  eGeometry geometry;
+  eVariation variation;
+  /** \brief resolved when the context is made: the class of geometry, and the homogeneous dimension (MDIM) */
+  eGeometryClass kind;
+  int dim;
+  };
+#endif
+
+/** \brief the context of the current global settings */
+EX geometry_context current_context() {
+  return geometry_context{geometry, variation, cgclass, MDIM};
+  }
+
+/** \brief the context of geometry g with homogeneous dimension dim, e.g., make_context(gSphere, 3) for the rotations of 3D space */
+EX geometry_context make_context(eGeometry g, int dim) {
+  return geometry_context{g, variation, ginf[g].g.kind, dim};
+  }
+
+#if HDR
+/** \brief the properties of the current geometry and variation, resolved from ginf in one place
+ *
+ *  With CAP_ACTIVE_GEOMETRY, the macros S7, S3, cgflags, cgclass, hyperbolic, euclid, sphere, WDIM,
+ *  GDIM, MDIM, STDVAR etc. read this block instead of evaluating ginf[geometry] and the flag
+ *  arithmetic at every use. cgag() just returns it, so it has to be refreshed whenever geometry or
+ *  variation changes: dynamicval<eGeometry> and dynamicval<eVariation> (specialized only in this
+ *  case) do this themselves, while code which assigns geometry or variation directly (set_geometry,
+ *  set_variation, enable_flat_model) or modifies the entries of ginf needs to call
+ *  refresh_active_geometry().
+ */
+struct active_geometry {
+  eGeometry geometry;
+  eVariation variation;
+  int sides, vertex;
+  flagtype flags;
+  eGeometryClass kind;
+  int gameplay_dimension, graphical_dimension, homogeneous_dimension;
+  bool is_hyperbolic, is_euclid, is_sphere, is_sol, is_nih, is_nil, is_sl2, is_nonisotropic;
+  bool is_pure, is_bitruncated, is_stdvar;
+  };
+
+extern active_geometry current_ag;
+void refresh_active_geometry();
+
+inline const active_geometry& cgag() { return current_ag; }
+
+#if CAP_ACTIVE_GEOMETRY
+/** \brief dynamicval on geometry, also refreshing current_ag (only needed if the macros read it) */
+template<> struct dynamicval<eGeometry> {
+  eGeometry &where;
+  eGeometry backup;
+  dynamicval(eGeometry &wh, eGeometry val) : where(wh) { backup = wh; wh = val; refresh(); }
+  dynamicval(eGeometry &wh) : where(wh) { backup = wh; }
+  ~dynamicval() { where = backup; refresh(); }
+  void refresh() { if(&where == &geometry) refresh_active_geometry(); }
+  };
+
+/** \brief dynamicval on variation, also refreshing current_ag */
+template<> struct dynamicval<eVariation> {
+  eVariation &where;
+  eVariation backup;
+  dynamicval(eVariation &wh, eVariation val) : where(wh) { backup = wh; wh = val; refresh(); }
+  dynamicval(eVariation &wh) : where(wh) { backup = wh; }
+  ~dynamicval() { where = backup; refresh(); }
+  void refresh() { if(&where == &variation) refresh_active_geometry(); }
+  };
+#endif
+#endif
+
+/** computed from ginf by active_geometry_ready in classes.cpp, before main() */
+active_geometry current_ag = { gGUARD };
+
+EX void refresh_active_geometry() {
+  auto& gi = ginf[geometry];
+  auto& ag = current_ag;
+  ag.geometry = geometry;
+  ag.variation = variation;
+  ag.sides = gi.sides;
+  ag.vertex = gi.vertex;
+  ag.flags = gi.flags;
+  ag.kind = gi.g.kind;
+  ag.gameplay_dimension = gi.g.gameplay_dimension;
+  ag.graphical_dimension = gi.g.graphical_dimension;
+  ag.homogeneous_dimension = gi.g.homogeneous_dimension;
+  ag.is_hyperbolic = ag.kind == gcHyperbolic;
+  ag.is_euclid = ag.kind == gcEuclid;
+  ag.is_sphere = ag.kind == gcSphere;
+  ag.is_sol = among(ag.kind, gcSol, gcSolN);
+  ag.is_nih = among(ag.kind, gcNIH, gcSolN);
+  ag.is_nil = ag.kind == gcNil;
+  ag.is_sl2 = ag.kind == gcSL2;
+  ag.is_nonisotropic = among(ag.kind, gcSol, gcSolN, gcNIH, gcSL2, gcNil);
+  ag.is_pure = variation == eVariation::pure;
+  ag.is_bitruncated = variation == eVariation::bitruncated;
+  ag.is_stdvar = ag.is_pure || ag.is_bitruncated;
+  }
 
 
 #if HDR
@@ -240,29 +355,54 @@ constexpr hyperpoint C03 = hyperpoint(0,0,0,1);
 
 EX ld squar(ld x) { return x*x; }
 
-EX int sig(int z) { return ginf[geometry].g.sig[z]; }
-
-EX int curvature() {
-  switch(cgclass) {
-    case gcEuclid: return 0;
+EX int curvature(const geometry_context& ctx) {
+  switch(ctx.kind) {
     case gcHyperbolic: return -1;
     case gcSphere: return 1;
-    case gcProduct: return PIU(curvature());
     default: return 0;
     }
   }
 
-EX ld sin_auto(ld x) {
-  switch(cgclass) {
-    case gcEuclid: return x;
+EX int curvature() {
+  if(cgclass == gcProduct) return PIU(curvature());
+  return curvature(current_context());
+  }
+
+/** in the isotropic classes, computed from the dimension of the context; otherwise, from ginf */
+EX int sig(const geometry_context& ctx, int z) {
+  switch(ctx.kind) {
+    case gcHyperbolic: case gcEuclid: case gcSphere:
+      return z < ctx.dim-1 ? 1 : z == ctx.dim-1 ? curvature(ctx) : 0;
+    default:
+      return ginf[ctx.geometry].g.sig[z];
+    }
+  }
+
+EX int sig(int z) { return sig(current_context(), z); }
+
+EX ld sin_auto(const geometry_context& ctx, ld x) {
+  switch(ctx.kind) {
     case gcHyperbolic: return sinh(x);
     case gcSphere: return sin(x);
-    case gcProduct: return PIU(sin_auto(x));
     case gcSL2: return sinh(x);
     default: return x;
     }
   }
 
+EX ld cos_auto(const geometry_context& ctx, ld x) {
+  switch(ctx.kind) {
+    case gcHyperbolic: return cosh(x);
+    case gcSphere: return cos(x);
+    case gcSL2: return cosh(x);
+    default: return 1;
+    }
+  }
+
+EX ld sin_auto(ld x) {
+  if(cgclass == gcProduct) return PIU(sin_auto(x));
+  return sin_auto(current_context(), x);
+  }
+
 EX ld asin_auto(ld x) {
   switch(cgclass) {
     case gcEuclid: return x;
@@ -336,14 +476,8 @@ EX ld acos_auto_clamp(ld x) {
   }
 
 EX ld cos_auto(ld x) {
-  switch(cgclass) {
-    case gcEuclid: return 1;
-    case gcHyperbolic: return cosh(x);
-    case gcSL2: return cosh(x);
-    case gcSphere: return cos(x);
-    case gcProduct: return PIU(cos_auto(x));
-    default: return 1;
-    }
+  if(cgclass == gcProduct) return PIU(cos_auto(x));
+  return cos_auto(current_context(), x);
   }
 
 EX ld tan_auto(ld x) {
@@ -744,15 +878,17 @@ EX transmatrix spin270() {
   return cspin90(1, 0);
   }
 
+/** uses the active rng_stream if there is one, see stream_guard */
 EX transmatrix random_spin3() {
-  ld alpha2 = asin(randd() * 2 - 1);
-  ld alpha = randd() * TAU;
-  ld alpha3 = randd() * TAU;
+  ld alpha2 = asin(srandd() * 2 - 1);
+  ld alpha = srandd() * TAU;
+  ld alpha3 = srandd() * TAU;
   return cspin(0, 1, alpha) * cspin(0, 2, alpha2) * cspin(1, 2, alpha3);
   }
 
+/** uses the active rng_stream if there is one, see stream_guard */
 EX transmatrix random_spin() {
-  if(WDIM == 2) return spin(randd() * TAU);
+  if(WDIM == 2) return spin(srandd() * TAU);
   else return random_spin3();
   }
 
@@ -818,12 +954,18 @@ EX transmatrix euaffine(hyperpoint h) {
 EX transmatrix cpush(int cid, ld alpha) {
   if(gproduct && cid == 2)
     return scale_matrix(Id, exp(alpha));
-  transmatrix T = Id;
   if(nonisotropic)
     return eupush3(cid == 0 ? alpha : 0, cid == 1 ? alpha : 0, cid == 2 ? alpha : 0);
-  T[LDIM][LDIM] = T[cid][cid] = cos_auto(alpha);
-  T[cid][LDIM] = sin_auto(alpha);
-  T[LDIM][cid] = -curvature() * sin_auto(alpha);
+  if(gproduct) return cpush(make_context(hybrid::underlying, MDIM), cid, alpha);
+  return cpush(current_context(), cid, alpha);
+  }
+
+EX transmatrix cpush(const geometry_context& ctx, int cid, ld alpha) {
+  transmatrix T = Id;
+  int l = ctx.dim - 1;
+  T[l][l] = T[cid][cid] = cos_auto(ctx, alpha);
+  T[cid][l] = sin_auto(ctx, alpha);
+  T[l][cid] = -curvature(ctx) * sin_auto(ctx, alpha);
   return T;
   }
 
@@ -1277,17 +1419,26 @@ EX transmatrix ggpushxto0(const hyperpoint& H, ld co) {
     auto d = product_decompose(H);
     return scale_matrix(PIU(ggpushxto0(d.second, co)), exp(d.first * co));
     }
+  return ggpushxto0(current_context(), H, co);
+  }
+
+EX transmatrix ggpushxto0(const geometry_context& ctx, const hyperpoint& H, ld co) {
   transmatrix res = Id;
-  if(sqhypot_d(GDIM, H) < 1e-16) return res;
-  ld fac = -curvature()/(H[LDIM]+1);
-  for(int i=0; i<GDIM; i++)
-  for(int j=0; j<GDIM; j++)
+  int l = ctx.dim - 1;
+  if(ctx.kind == gcEuclid) {
+    for(int i=0; i<l; i++) res[i][l] = H[i] * co;
+    return res;
+    }
+  if(sqhypot_d(l, H) < 1e-16) return res;
+  ld fac = -curvature(ctx)/(H[l]+1);
+  for(int i=0; i<l; i++)
+  for(int j=0; j<l; j++)
     res[i][j] += H[i] * H[j] * fac;
 
-  for(int d=0; d<GDIM; d++)
-    res[d][LDIM] = co * H[d],
-    res[LDIM][d] = -curvature() * co * H[d];
-  res[LDIM][LDIM] = H[LDIM];
+  for(int d=0; d<l; d++)
+    res[d][l] = co * H[d],
+    res[l][d] = -curvature(ctx) * co * H[d];
+  res[l][l] = H[l];
 
   return res;
   }
@@ -1306,6 +1457,14 @@ EX shiftmatrix rgpushxto0(const shiftpoint& H) {
   return shiftless(rgpushxto0(H.h), H.shift);
   }
 
+EX transmatrix gpushxto0(const geometry_context& ctx, const hyperpoint& H) {
+  return ggpushxto0(ctx, H, -1);
+  }
+
+EX transmatrix rgpushxto0(const geometry_context& ctx, const hyperpoint& H) {
+  return ggpushxto0(ctx, H, 1);
+  }
+
 /** \brief Fix the numerical inaccuracies in the isometry T
  *
  *  The nature of hyperbolic geometry makes the computations numerically unstable.
@@ -1322,40 +1481,48 @@ EX void fixmatrix(transmatrix& T) {
     PIU(fixmatrix(T));
     T = scale_matrix(T, exp(+z));
     }
-  else if(euclid)
-    fixmatrix_euclid(T);
   else
-    orthonormalize(T);
+    fixmatrix(current_context(), T);
   }
 
-EX void fixmatrix_euclid(transmatrix& T) {
-  for(int x=0; x<GDIM; x++) for(int y=0; y<=x; y++) {
+EX void fixmatrix_euclid(transmatrix& T) { fixmatrix_euclid(current_context(), T); }
+
+EX void orthonormalize(transmatrix& T) { orthonormalize(current_context(), T); }
+
+EX void orthonormalize(const geometry_context& ctx, transmatrix& T) {
+  for(int x=0; x<ctx.dim; x++) for(int y=0; y<=x; y++) {
     ld dp = 0;
-    for(int z=0; z<GDIM; z++) dp += T[z][x] * T[z][y];
+    for(int z=0; z<MAXMDIM; z++) dp += T[z][x] * T[z][y] * sig(ctx, z);
 
-    if(y == x) dp = 1 - sqrt(1/dp);
+    if(y == x) dp = 1 - sqrt(sig(ctx, x)/dp);
 
-    for(int z=0; z<GDIM; z++) T[z][x] -= dp * T[z][y];
+    for(int z=0; z<MAXMDIM; z++) T[z][x] -= dp * T[z][y];
     }
-  for(int x=0; x<GDIM; x++) T[LDIM][x] = 0;
-  T[LDIM][LDIM] = 1;
   }
 
-EX void orthonormalize(transmatrix& T) {
-  for(int x=0; x<MDIM; x++) for(int y=0; y<=x; y++) {
+EX void fixmatrix(const geometry_context& ctx, transmatrix& T) {
+  if(ctx.kind == gcEuclid) fixmatrix_euclid(ctx, T);
+  else orthonormalize(ctx, T);
+  }
+
+/** \brief fixmatrix for Euclidean isometries: orthonormalize the linear part, and clear the last row */
+EX void fixmatrix_euclid(const geometry_context& ctx, transmatrix& T) {
+  int l = ctx.dim - 1;
+  for(int x=0; x<l; x++) for(int y=0; y<=x; y++) {
     ld dp = 0;
-    for(int z=0; z<MXDIM; z++) dp += T[z][x] * T[z][y] * sig(z);
+    for(int z=0; z<l; z++) dp += T[z][x] * T[z][y];
 
-    if(y == x) dp = 1 - sqrt(sig(x)/dp);
+    if(y == x) dp = 1 - sqrt(1/dp);
 
-    for(int z=0; z<MXDIM; z++) T[z][x] -= dp * T[z][y];
+    for(int z=0; z<l; z++) T[z][x] -= dp * T[z][y];
     }
+  for(int x=0; x<l; x++) T[l][x] = 0;
+  T[l][l] = 1;
   }
 
 /** fix a 3D rotation matrix */
 EX void fix_rotation(transmatrix& rot) {
-  dynamicval<eGeometry> g(geometry, gSphere);
-  fixmatrix(rot);
+  orthonormalize(make_context(gSphere, 3), rot);
   for(int i=0; i<3; i++) rot[i][3] = rot[3][i] = 0;
   rot[3][3] = 1;
   }
@@ -1404,7 +1571,7 @@ EX ld det(const transmatrix& T) {
 
 /** warning about incorrect inverse */
 void inverse_error(const transmatrix& T) {
-  println(hlog, "Warning: inverting a singular matrix: ", T);
+  SLOG("Warning: inverting a singular matrix: ", T);
   }
 
 /** inverse of a 3x3 matrix */
@@ -1947,10 +2114,16 @@ inline shiftpoint tC0(const shiftmatrix &T) {
 EX hyperpoint xspinpush0(ld alpha, ld x) {
   if(embedded_plane) return lspinpush0(alpha, x);
   if(sl2) return slr::polar(x, -alpha, 0);
+  /* in product geometries, the horizontal part is computed in the underlying geometry */
+  if(cgclass == gcProduct) return xspinpush0(make_context(hybrid::underlying, MDIM), alpha, x);
+  return xspinpush0(current_context(), alpha, x);
+  }
+
+EX hyperpoint xspinpush0(const geometry_context& ctx, ld alpha, ld x) {
   hyperpoint h = Hypc;
-  h[LDIM] = cos_auto(x);
-  h[0] = sin_auto(x) * cos(alpha);
-  h[1] = sin_auto(x) * -sin(alpha);
+  h[ctx.dim-1] = cos_auto(ctx, x);
+  h[0] = sin_auto(ctx, x) * cos(alpha);
+  h[1] = sin_auto(ctx, x) * -sin(alpha);
   return h;
   }
 
@@ -2105,6 +2278,26 @@ EX hyperpoint lerp(hyperpoint a0, hyperpoint a1, ld x) {
   return a0 + (a1-a0) * x;
   }
 
+#if HDR
+/** \brief bits of precision_status */
+enum ePrecisionStatus { psOK = 0, psAmbiguous = 1, psDegenerate = 2 };
+#endif
+
+/** \brief precision problems found in this thread since it was last cleared (see ePrecisionStatus) */
+EX thread_local int precision_status;
+
+/** \brief if set, same_point_may_warn reports ambiguous points in precision_status instead of throwing hr_precision_error
+ *
+ *  Set it with dynamicval around a batch of computations, and check precision_status afterwards.
+ */
+EX thread_local bool precision_nothrow;
+
+/** \brief mark h as degenerate in precision_status if it is not finite */
+EX hyperpoint check_finite(hyperpoint h) {
+  for(int i=0; i<MXDIM; i++) if(!std::isfinite(h[i])) { precision_status |= psDegenerate; break; }
+  return h;
+  }
+
 EX hyperpoint linecross(hyperpoint a, hyperpoint b, hyperpoint c, hyperpoint d) {
   a /= a[LDIM];
   b /= b[LDIM];
@@ -2124,7 +2317,7 @@ EX hyperpoint linecross(hyperpoint a, hyperpoint b, hyperpoint c, hyperpoint d)
   res[2] = 0;
   res[3] = 0;
   res[GDIM] = 1;
-  return normalize(res);
+  return check_finite(normalize(res));
   }
 
 EX ld inner2(hyperpoint h1, hyperpoint h2) {
@@ -2151,7 +2344,7 @@ EX hyperpoint circumscribe(hyperpoint a, hyperpoint b, hyperpoint c) {
     h[1] += (c2*b[0] - b2 * c[0]) / det;
     h[0] += (c2*b[1] - b2 * c[1]) / -det;
 
-    return h;
+    return check_finite(h);
     }
 
   if(inner2(b,b) < 0) {
@@ -2180,7 +2373,7 @@ EX hyperpoint circumscribe(hyperpoint a, hyperpoint b, hyperpoint c) {
   if(i > 0) h /= sqrt(i);
   else h /= -sqrt(-i);
 
-  return h;
+  return check_finite(h);
   }
 
 EX ld inner3(hyperpoint h1, hyperpoint h2) {
@@ -2217,7 +2410,7 @@ EX hyperpoint circumscribe(hyperpoint a, hyperpoint b, hyperpoint c, hyperpoint
   if(i > 0) h /= sqrt(i);
   else h /= -sqrt(-i);
 
-  return h;
+  return check_finite(h);
   }
 
 /** the point in distance dist from 'material' to 'dir' (usually an (ultra)ideal point) */
@@ -2237,11 +2430,19 @@ EX ld worst_precision_error;
 struct hr_precision_error : hr_exception { hr_precision_error() : hr_exception("precision error") {} };
 #endif
 
-/** check if a and b are the same, testing for equality. Throw an exception or warning if not sure */
+/** check if a and b are the same, testing for equality. Throw an exception or warning if not sure
+ *
+ *  With precision_nothrow, an ambiguous pair is reported as psAmbiguous in precision_status, and treated as different points.
+ */
 EX bool same_point_may_warn(hyperpoint a, hyperpoint b) {
   ld d = hdist(a, b);
   if(d > 1e-2) return false;
-  if(d > 1e-3) throw hr_precision_error();
+  if(d > 1e-3) {
+    if(!precision_nothrow) throw hr_precision_error();
+    SLOG("precision error: distance ", d, " between ", a, " and ", b);
+    precision_status |= psAmbiguous;
+    return false;
+    }
   if(d > 1e-6 && worst_precision_error <= 1e-6)
     addMessage("warning: precision errors are building up!");
   if(d > worst_precision_error) worst_precision_error = d;
@@ -139,6 +139,9 @@ namespace hr
     /** \brief Table of moves. This is the maximum size, but tailored_alloc allocates less. */
     T *move_table[FULL_EDGE + (FULL_EDGE + sizeof(char *) - 1) / sizeof(char *)];
 
+    /** \brief the number of bytes tailored_alloc needs for a table with the given degree */
+    static constexpr int tailored_size(int degree) { return offsetof(connection_table, move_table) + sizeof(T *) * degree + degree; }
+
     unsigned char *spintable() { return (unsigned char *)(&move_table[full()->degree()]); }
 
     /** \brief get the full T from the pointer to this connection table */
@@ -183,12 +186,70 @@ namespace hr
     }
   };
 
+#ifndef NO_TAILORED_ALLOC
+#ifndef NO_TAILORED_SLAB
+  /** \brief size (and alignment) of the chunks from which tailored_alloc carves objects */
+  static const size_t tailored_chunk_size = 1 << 16;
+
+  struct tailored_slab;
+
+  /** \brief a chunk of a tailored_slab, placed at the start of its aligned memory block */
+  struct tailored_chunk
+  {
+    tailored_slab *slab;
+    /** \brief the unused part of the chunk is [bump, end) */
+    char *bump, *end;
+    /** \brief objects freed by tailored_delete, linked through their first bytes */
+    void *freelist;
+    /** \brief the next chunk of the same slab */
+    tailored_chunk *next;
+    bool in_partial;
+    void *take();
+  };
+
+  /** \brief all objects of a single size (i.e., a single type and degree)
+   *
+   *  Objects are bump-allocated from large aligned chunks, so that cells and heptagons created
+   *  one after another (usually neighbors) end up next to each other in memory, and freed objects
+   *  are reused. Like the rest of the map generation, this is not thread-safe: cells are only
+   *  created and deleted by the main thread.
+   */
+  struct tailored_slab
+  {
+    size_t size;
+    /** \brief all chunks; the first one is the one we currently bump-allocate from */
+    tailored_chunk *chunks;
+    /** \brief chunks which have something in their freelist */
+    vector<tailored_chunk *> partial;
+    int live;
+    void *alloc(size_t objsize);
+    void release(void *p);
+  };
+
+  inline tailored_chunk *tailored_chunk_of(void *p)
+  {
+    return (tailored_chunk *)((size_t)p & ~(tailored_chunk_size - 1));
+  }
+
+  /** \brief the slab for objects of class T with the given degree */
+  template <class T>
+  tailored_slab &tailored_slab_for(int degree)
+  {
+    static tailored_slab slabs[FULL_EDGE + 1];
+    return slabs[degree];
+  }
+#endif
+#endif
+
   /** \brief Allocate a class T with a connection_table, but with only `degree` connections.
    *
    *  Also set yet unknown connections to NULL.
    *
    * Generating the hyperbolic world consumes lots of
    * RAM, so we really need to be careful on low memory devices.
+   *
+   * Unless NO_TAILORED_SLAB is defined, the memory comes from a slab per type and degree (see
+   * tailored_slab).
    */
 
   template <class T>
@@ -196,15 +257,21 @@ namespace hr
   {
     T *result;
 #ifndef NO_TAILORED_ALLOC
-    int b = offsetof(T, c) + offsetof(connection_table<T>, move_table) + sizeof(T *) * degree + degree;
+    int b = offsetof(T, c) + decltype(T::c)::tailored_size(degree);
+#ifndef NO_TAILORED_SLAB
+    auto &slab = tailored_slab_for<T>(degree);
+    /* also room and alignment for the freelist link */
+    size_t al = max(alignof(T), alignof(void *));
+    result = (T *)slab.alloc((max<size_t>(b, sizeof(void *)) + al - 1) / al * al);
+#else
     result = (T *)new char[b];
+#endif
     new (result) T();
 #else
     result = new T;
 #endif
     result->type = degree;
-    for (int i = 0; i < degree; i++)
-      result->c.move_table[i] = NULL;
+    result->c.fullclear();
     return result;
   }
 
@@ -212,8 +279,13 @@ namespace hr
   template <class T>
   void tailored_delete(T *x)
   {
+#if !defined(NO_TAILORED_ALLOC) && !defined(NO_TAILORED_SLAB)
+    x->~T();
+    tailored_chunk_of(x)->slab->release(x);
+#else
     x->~T();
     delete[] ((char *)(x));
+#endif
   }
 
   static const struct wstep_t
@@ -235,6 +307,27 @@ namespace hr
 
   extern int hrand(int);
 
+  /** \brief how many new cells (or heptagons) a read-only traversal is allowed to create
+   *
+   *  Read-only traversals (walker::try_step, readonly_celllister) normally never create anything;
+   *  a budget lets them generate a bounded number of missing neighbors on demand.
+   */
+  struct generation_budget
+  {
+    int remaining;
+    int used;
+    explicit generation_budget(int r) : remaining(r), used(0) {}
+    /** \brief may we create one more? */
+    bool take()
+    {
+      if (remaining <= 0)
+        return false;
+      remaining--;
+      used++;
+      return true;
+    }
+  };
+
   /** \brief the walker structure is used for walking on surfaces defined via \ref connection_table. */
   template <class T>
   struct walker
@@ -279,6 +372,26 @@ namespace hr
       spin = nspin;
       return (*this);
     }
+    /** \brief like adding wstep, but only create the T we are facing if the budget allows it
+     *
+     *  Returns false, and stays where it was, if the T we are facing is not known yet and
+     *  could not be created.
+     */
+    bool try_step(generation_budget *budget = nullptr)
+    {
+      if (!peek())
+      {
+        if (!budget || !budget->take())
+          return false;
+        at->cmove(spin);
+      }
+      int nspin = at->c.spin(spin);
+      if (at->c.mirror(spin))
+        mirrored = !mirrored;
+      at = at->move(spin);
+      spin = nspin;
+      return true;
+    }
     /** \brief add wrev to face the other direction, may be non-deterministic and use hrand */
     walker<T> &operator+=(rev_t)
     {
@@ -467,6 +580,265 @@ namespace hr
   typedef walker<heptagon> heptspin;
   typedef walker<cell> cellwalker;
 
+  /** \brief a range over the neighbors of a cell, to be used instead of the forCell macros
+   *
+   *  for(cell *c2: adj_cm(c)) is equivalent to forCellCM(c2, c), for(cell *c2: adj_ex(c)) to
+   *  forCellEx(c2, c), and for(cell *c2: adj_nocreate(c)) to forCellIdAll, i.e., it visits
+   *  move(i) for every i, including NULL. Note that, unlike forCellAll, adj_nocreate never creates
+   *  the missing neighbors: use adj_cm for that.
+   *  The direction of the current neighbor is available as the iterator's i when iterating by hand.
+   */
+  struct adj_range
+  {
+    enum eMode
+    {
+      amNoCreate,
+      amExisting,
+      amCreate
+    };
+    cell *c;
+    eMode mode;
+
+    struct iterator
+    {
+      cell *c;
+      int i;
+      eMode mode;
+      void skip()
+      {
+        if (mode == amExisting)
+          while (i < c->type && !c->move(i))
+            i++;
+      }
+      cell *operator*() const { return mode == amCreate ? createMov(c, i) : c->move(i); }
+      iterator &operator++()
+      {
+        i++;
+        skip();
+        return *this;
+      }
+      bool operator!=(const iterator &x) const { return i != x.i; }
+    };
+
+    iterator begin() const
+    {
+      iterator it{c, 0, mode};
+      it.skip();
+      return it;
+    }
+    iterator end() const { return iterator{c, c->type, mode}; }
+  };
+
+  inline adj_range adj_nocreate(cell *c) { return adj_range{c, adj_range::amNoCreate}; }
+  inline adj_range adj_ex(cell *c) { return adj_range{c, adj_range::amExisting}; }
+  inline adj_range adj_cm(cell *c) { return adj_range{c, adj_range::amCreate}; }
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HR_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define HR_PREFETCH(p) ((void)0)
+#endif
+
+  /** \brief prefetch what stepping from `at` in direction d will read
+   *
+   *  Stepping reads the header of at (the degree, which locates the spin table) and the move
+   *  pointer, which for larger degrees are in different cache lines; the spin byte usually shares
+   *  a line with one of them. Issuing both prefetches at once lets the misses overlap rather than
+   *  happen one after another. This must not read *at, or it would wait for the first miss.
+   */
+  template <class T>
+  void prefetch_step(T *at, int d)
+  {
+    HR_PREFETCH(at);
+    HR_PREFETCH(&at->c.move_table[d]);
+  }
+
+  /** \brief the edge a walker will use after entering a T through edge `back` (mirrored or not) and turning by i
+   *
+   *  This is computed without reading the T, assuming that its degree is deg; callers use the degree
+   *  of the previous T, which is exact in regular tilings. A wrong guess only wastes a prefetch.
+   */
+  inline int guess_next_edge(int back, bool mirrored, int i, int deg)
+  {
+    return gmod(back + (mirrored ? -i : i), deg);
+  }
+
+  /** \brief make n steps from cw, each preceded by turning by pattern[i % pattern.size()]
+   *
+   *  Equivalent to a loop of cw += pattern[i]; cw += wstep; but as soon as the next T is known,
+   *  its header and the edge the following step will use are prefetched together, without reading
+   *  the next T (see guess_next_edge). An empty pattern means walking without turning.
+   */
+  template <class T>
+  walker<T> walk_n(walker<T> cw, const vector<int> &pattern, int n)
+  {
+    int k = isize(pattern);
+    for (int i = 0; i < n; i++)
+    {
+      if (k)
+        cw += pattern[i % k];
+      T *nxt = cw.at->cmove(cw.spin);
+      int back = cw.at->c.spin(cw.spin);
+      bool nmirrored = cw.mirrored ^ cw.at->c.mirror(cw.spin);
+      prefetch_step(nxt, guess_next_edge(back, nmirrored, k ? pattern[(i + 1) % k] : 0, cw.at->type));
+      cw += wstep;
+    }
+    return cw;
+  }
+
+  /** \brief the turn which makes a walker, which has just stepped, continue straight
+   *
+   *  For even degrees this is the opposite edge; for odd degrees, we alternate between the two
+   *  edges closest to the opposite, according to parity.
+   */
+  inline int straight_turn(int deg, int parity)
+  {
+    return deg / 2 + ((deg & 1) ? parity : 0);
+  }
+
+  template <class T>
+  int straight_turn(T *at, int parity)
+  {
+    return straight_turn(int(at->type), parity);
+  }
+
+  /** \brief iterate over the cellwalkers (or heptspins) on a straight line
+   *
+   *  Usage: for(cellwalker cw: straight_line<cell>(start, n)) ...
+   *  The first element is start itself; each next one is obtained by stepping forward and turning
+   *  by straight_turn. The T after the current one is prefetched, together with the edge it will
+   *  be left through, while the current one is used.
+   */
+  template <class T>
+  struct straight_line
+  {
+    walker<T> start;
+    int length;
+
+    struct iterator
+    {
+      walker<T> cw;
+      int i, parity;
+      walker<T> operator*() const { return cw; }
+      bool operator!=(const iterator &x) const { return i != x.i; }
+      iterator &operator++()
+      {
+        cw += wstep;
+        cw += straight_turn(cw.at, parity);
+        parity ^= 1;
+        i++;
+        T *nxt = cw.at->move(cw.spin);
+        if (nxt)
+        {
+          int deg = cw.at->type;
+          bool nmirrored = cw.mirrored ^ cw.at->c.mirror(cw.spin);
+          prefetch_step(nxt, guess_next_edge(cw.at->c.spin(cw.spin), nmirrored, straight_turn(deg, parity), deg));
+        }
+        return *this;
+      }
+    };
+
+    straight_line(walker<T> s, int n) : start(s), length(n) {}
+    iterator begin() const { return iterator{start, 0, 0}; }
+    iterator end() const { return iterator{start, length, 0}; }
+  };
+
+  /** \brief a per-thread pool of vectors, so that transient lists (such as those of celllister) reuse
+   *  the capacity of the previous ones instead of reallocating as they grow
+   */
+  template <class T>
+  struct recycled_vectors
+  {
+    static const int MAX_SPARE = 8;
+    vector<vector<T>> spare;
+
+    vector<T> take(int estimate)
+    {
+      vector<T> v;
+      if (!spare.empty())
+      {
+        v = std::move(spare.back());
+        spare.pop_back();
+      }
+      v.reserve(estimate);
+      return v;
+    }
+
+    void give(vector<T> &v)
+    {
+      v.clear();
+      if (v.capacity() && isize(spare) < MAX_SPARE)
+        spare.push_back(std::move(v));
+    }
+  };
+
+  template <class T>
+  recycled_vectors<T> &recycled()
+  {
+    static thread_local recycled_vectors<T> r;
+    return r;
+  }
+
+  /** \brief a guess of how many cells celllister(orig, maxdist, maxcount, ...) will list, based on the degree and the radius */
+  inline int celllister_estimate(cell *orig, int maxdist, int maxcount)
+  {
+    ld total = 1, ring = orig->type;
+    for (int d = 0; d < maxdist && total < maxcount; d++)
+    {
+      total += ring;
+      ring = hyperbolic ? ring * 1.6 : ring + orig->type;
+    }
+    return int(min<ld>(total, min(maxcount, 1 << 16)));
+  }
+
+  /** \brief the BFS shared by the cell listers
+   *
+   *  lst initially contains the origin (at distance 0). expand(from, to, d) has to add the
+   *  neighbors of lst[from..to), which are all at distance d, to lst, and return true to stop
+   *  (when breakon has been found). The search also stops after maxdist levels, or at the end of
+   *  the level during which lst reached maxcount cells.
+   */
+  template <class Expand>
+  void bfs_by_levels(const vector<cell *> &lst, int maxdist, int maxcount, const Expand &expand)
+  {
+    int level_start = 0;
+    for (int d = 0; maxdist; d++)
+    {
+      int level_end = isize(lst);
+      if (expand(level_start, level_end, d))
+        return;
+      level_start = level_end;
+      if (isize(lst) >= maxcount || d + 1 == maxdist || level_start == isize(lst))
+        return;
+    }
+  }
+
+  /** \brief the sequential listers: the marks are given by L (via L::add_at), and neighbor(c, j)
+   *  returns the neighbor of c in direction j to follow, or NULL to skip that edge
+   */
+  template <class L, class Neighbor>
+  void list_cells(L &l, cell *orig, int maxdist, int maxcount, cell *breakon, const Neighbor &neighbor)
+  {
+    l.add_at(orig, 0);
+    bfs_by_levels(l.lst, maxdist, maxcount, [&](int from, int to, int d)
+    {
+      for (int i = from; i < to; i++)
+      {
+        cell *c = l.lst[i];
+        for (int j = 0; j < c->type; j++)
+        {
+          cell *c2 = neighbor(c, j);
+          if (!c2)
+            continue;
+          l.add_at(c2, d + 1);
+          if (c2 == breakon)
+            return true;
+        }
+      }
+      return false;
+    });
+  }
+
   /** \brief A structure useful when walking on the cell graph in arbitrary way, or listing cells in general.
    *
    * Only one celllister may be active at a time, using the stack semantics.
@@ -479,6 +851,9 @@ namespace hr
     vector<cell *> lst;
     vector<int> tmps;
 
+    /** \brief the vectors come from recycled(), with capacity for estimate cells */
+    explicit manual_celllister(int estimate = 0) : lst(recycled<cell *>().take(estimate)), tmps(recycled<int>().take(estimate)) {}
+
     /** \brief is the given cell on the list? */
     bool listed(cell *c)
     {
@@ -500,6 +875,8 @@ namespace hr
     {
       for (int i = 0; i < isize(lst); i++)
         lst[i]->listindex = tmps[i];
+      recycled<cell *>().give(lst);
+      recycled<int>().give(tmps);
     }
   };
 
@@ -521,32 +898,258 @@ namespace hr
     @param breakon we are actually looking for this cell, so stop when reaching it
     */
     celllister(cell *orig, int maxdist, int maxcount, cell *breakon)
+        : celllister(orig, maxdist, maxcount, breakon, celllister_estimate(orig, maxdist, maxcount)) {}
+
+    /** \brief the same, with the capacity of the lists given (so that the estimate is computed once) */
+    celllister(cell *orig, int maxdist, int maxcount, cell *breakon, int estimate)
+        : manual_celllister(estimate), dists(recycled<int>().take(estimate))
     {
-      add_at(orig, 0);
-      cell *last = orig;
+      list_cells(*this, orig, maxdist, maxcount, breakon, [](cell *c, int j) { return createMov(c, j); });
+    }
+
+    ~celllister() { recycled<int>().give(dists); }
+
+    /** \brief for a given cell c on the list, return its distance from orig */
+    int getdist(cell *c) { return dists[c->listindex]; }
+  };
+
+  /** \brief a re-entrant alternative to manual_celllister
+   *
+   *  manual_celllister marks the listed cells via cell::listindex, so only one of them can be
+   *  active at a time, and it has to restore the old values when destroyed. This one keeps its
+   *  marks in its own open-addressing table keyed by cell pointers, so it does not write to the
+   *  cells at all: any number of them can coexist (also in different threads, as long as the map
+   *  is not changed meanwhile), and destroying one is just freeing its vectors.
+   */
+  struct reentrant_manual_celllister
+  {
+    /** \brief list of cells in this list */
+    vector<cell *> lst;
+    /** \brief hash table of (index in lst)+1, 0 for empty slots; the size is a power of 2 */
+    vector<int> slots;
+
+    static size_t hash(cell *c)
+    {
+      size_t h = (size_t)c;
+      h ^= h >> 17;
+      h *= (size_t)0x9E3779B97F4A7C15ull;
+      return h ^ (h >> 29);
+    }
+
+    int &slot(cell *c)
+    {
+      size_t mask = slots.size() - 1;
+      size_t h = hash(c) & mask;
+      while (slots[h] && lst[slots[h] - 1] != c)
+        h = (h + 1) & mask;
+      return slots[h];
+    }
+
+    void rehash(int size)
+    {
+      slots.assign(size, 0);
       for (int i = 0; i < isize(lst); i++)
+        slot(lst[i]) = i + 1;
+    }
+
+    /** \brief the index of c in lst, or -1 if not listed */
+    int index_of(cell *c)
+    {
+      if (slots.empty())
+        return -1;
+      return slot(c) - 1;
+    }
+
+    /** \brief is the given cell on the list? */
+    bool listed(cell *c) { return index_of(c) >= 0; }
+
+    /** \brief add a cell to the list */
+    bool add(cell *c)
+    {
+      if (2 * (isize(lst) + 1) > isize(slots))
+        rehash(max(16, 2 * isize(slots)));
+      int &s = slot(c);
+      if (s)
+        return false;
+      lst.push_back(c);
+      s = isize(lst);
+      return true;
+    }
+  };
+
+  /** \brief like celllister, but re-entrant, see reentrant_manual_celllister
+   *
+   *  As celllister, this creates the missing neighbors, so it is re-entrant on the main thread
+   *  only; readonly_celllister without a budget does not change the map.
+   */
+  struct reentrant_celllister : reentrant_manual_celllister
+  {
+    vector<int> dists;
+
+    void add_at(cell *c, int d)
+    {
+      if (add(c))
+        dists.push_back(d);
+    }
+
+    /** \brief the same parameters as in celllister */
+    reentrant_celllister(cell *orig, int maxdist, int maxcount, cell *breakon)
+    {
+      list_cells(*this, orig, maxdist, maxcount, breakon, [](cell *c, int j) { return createMov(c, j); });
+    }
+
+    /** \brief for a given cell c on the list, return its distance from orig */
+    int getdist(cell *c) { return dists[index_of(c)]; }
+  };
+
+  /** \brief like celllister, but does not change the map
+   *
+   *  Only the known neighbors (move()) are followed. Edges leading to cells which do not exist
+   *  yet are recorded in `unexplored`, unless the budget allows creating them. The marks are kept
+   *  as in reentrant_manual_celllister, so the cells are not written to at all.
+   */
+  struct readonly_celllister : reentrant_manual_celllister
+  {
+    vector<int> dists;
+    /** \brief edges (cell, direction) where the BFS stopped because the neighbor was not generated */
+    vector<pair<cell *, int>> unexplored;
+
+    void add_at(cell *c, int d)
+    {
+      if (add(c))
+        dists.push_back(d);
+    }
+
+    /** \brief the same parameters as in celllister; budget may be NULL to never generate anything */
+    readonly_celllister(cell *orig, int maxdist, int maxcount, cell *breakon, generation_budget *budget = nullptr)
+    {
+      list_cells(*this, orig, maxdist, maxcount, breakon, [&](cell *c, int j)
       {
-        cell *c = lst[i];
-        if (maxdist)
-          forCellCM(c2, c)
-          {
-            add_at(c2, dists[i] + 1);
-            if (c2 == breakon)
-              return;
-          }
-        if (c == last)
-        {
-          if (isize(lst) >= maxcount || dists[i] + 1 == maxdist)
-            break;
-          last = lst[isize(lst) - 1];
-        }
-      }
+        cell *c2 = c->move(j);
+        if (c2)
+          return c2;
+        if (budget && budget->take())
+          return createMov(c, j);
+        unexplored.emplace_back(c, j);
+        return (cell *)nullptr;
+      });
     }
 
     /** \brief for a given cell c on the list, return its distance from orig */
-    int getdist(cell *c) { return dists[c->listindex]; }
+    int getdist(cell *c) { return dists[index_of(c)]; }
+
+    /** \brief is the result complete, i.e., no edges within range were left unexplored? */
+    bool complete() { return unexplored.empty(); }
   };
 
+  /** \brief a hot/cold split view of a part of the cell graph
+   *
+   *  struct cell mixes the fields needed to traverse the graph with the gameplay fields from
+   *  gcell, so a BFS which only needs adjacency still pulls in whole cells. This view assigns
+   *  dense ids to a set of cells and keeps the traversal data in compact hot arrays:
+   *  for each id the degree and the offset of its edges, and for each edge the id of the neighbor
+   *  (or NOID) and the spin. The gameplay data is the parallel cold array, indexed by the same ids;
+   *  it refers to the actual cells, so it never needs to be synchronized.
+   */
+  struct hotcold_graph
+  {
+    static const uint32_t NOID = uint32_t(-1);
+
+    struct hot_cell
+    {
+      uint32_t first_edge;
+      unsigned char type;
+    };
+
+    /** \brief hot data, indexed by id */
+    vector<hot_cell> hot;
+    /** \brief hot data, indexed by hot[id].first_edge + direction */
+    vector<uint32_t> neighbors;
+    vector<unsigned char> spins;
+    /** \brief cold data: the cell, and thus its gcell, for each id */
+    vector<cell *> cold;
+    /** \brief cell to id */
+    reentrant_manual_celllister ids;
+
+    /** \brief build the view for the given cells; edges leading outside of the list get NOID */
+    hotcold_graph(const vector<cell *> &cells);
+
+    int size() const { return isize(hot); }
+    int degree(uint32_t id) const { return hot[id].type; }
+    uint32_t move(uint32_t id, int d) const { return neighbors[hot[id].first_edge + d]; }
+    int spin(uint32_t id, int d) const { return spins[hot[id].first_edge + d] & 127; }
+    bool mirror(uint32_t id, int d) const { return spins[hot[id].first_edge + d] & 128; }
+    gcell &game(uint32_t id) const { return *cold[id]; }
+    cell *at(uint32_t id) const { return cold[id]; }
+    /** \brief the id of c, or NOID */
+    uint32_t id_of(cell *c)
+    {
+      int i = ids.index_of(c);
+      return i < 0 ? NOID : i;
+    }
+
+    /** \brief distances from the given id, using the hot data only; -1 for unreachable */
+    vector<int> distances(uint32_t from, int maxdist) const;
+  };
+
+#if CAP_THREAD
+  /** \brief a set of cells which can be inserted into concurrently; values are assigned by the owner */
+  struct concurrent_cellset
+  {
+    vector<std::atomic<cell *>> keys;
+    vector<int> values;
+    size_t mask;
+
+    void init(int size);
+    /** \brief insert c; returns its slot if it was not there yet, -1 otherwise */
+    int insert(cell *c);
+    /** \brief the slot of c, or -1 */
+    int find(cell *c) const;
+  };
+
+  /** \brief threads which stay alive across the levels of a parallel_celllister
+   *
+   *  execute(qty, f) runs f(0) in the calling thread and f(1), ..., f(qty-1) in the workers, and
+   *  returns when all of them are done.
+   */
+  struct bfs_worker_pool
+  {
+    int size;
+    vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable start, done;
+    const std::function<void(int)> *job = nullptr;
+    int generation = 0, used = 0, pending = 0;
+    bool quit = false;
+
+    explicit bfs_worker_pool(int threads) : size(threads) {}
+    ~bfs_worker_pool();
+    void execute(int qty, const std::function<void(int)> &f);
+    void run(int t);
+  };
+
+  /** \brief celllister which expands each BFS level in parallel
+   *
+   *  Each frontier is split between the given number of threads (by default, one per core).
+   *  Visited cells are marked in a concurrent_cellset. Cells are never created by the worker
+   *  threads: edges which are not known yet are queued, and generated (via createMov) by the
+   *  calling thread after the level is done. Cells come in BFS order, but the order within a level
+   *  is not deterministic. The parameters are the same as in celllister, except that breakon
+   *  and maxcount are only checked at the end of each level.
+   */
+  struct parallel_celllister
+  {
+    vector<cell *> lst;
+    vector<int> dists;
+    concurrent_cellset marks;
+
+    parallel_celllister(cell *orig, int maxdist, int maxcount, cell *breakon, int threads = 0);
+
+    bool listed(cell *c) const { return marks.find(c) >= 0; }
+    int getdist(cell *c) const { return dists[marks.values[marks.find(c)]]; }
+  };
+#endif
+
   /** \brief translate heptspins to cellwalkers and vice versa */
   static const struct cth_t
   {
@@ -616,6 +1219,58 @@ namespace hr
     }
     bool mirror() { return s->c.mirror(d); }
   };
+
+  /** \brief everything about a single edge of a cell, as computed by neighbor_records */
+  struct neighbor_record
+  {
+    /** \brief the neighbor, NULL if not generated (and not requested to create) */
+    cell *t;
+    /** \brief the direction from the cell to t */
+    unsigned char d;
+    /** \brief the direction from t back to the cell, i.e., c->c.spin(d) */
+    unsigned char rev;
+    bool mirror;
+    movei as_movei(cell *s) const { return movei(s, t, d); }
+  };
+
+  /** \brief the neighbor records of a cell, computed in a single pass over its connection table
+   *
+   *  Meant for inner loops (pathfinding etc.) which would otherwise call movei::proper(),
+   *  rev_dir_or() and c->c.spin(d) again and again for each neighbor. The records are a snapshot:
+   *  they are not updated when the map grows, so keep them only for the duration of the loop.
+   *  Usage: for(auto& r: neighbor_records(c, true)) ... r.t, r.d, r.rev, r.mirror
+   */
+  struct neighbor_records
+  {
+    static const int LOCAL = 16;
+    neighbor_record local[LOCAL];
+    vector<neighbor_record> big;
+    neighbor_record *b, *e;
+
+    /** \brief if create is true, missing neighbors are created, as in forCellCM */
+    neighbor_records(cell *c, bool create)
+    {
+      int t = c->type;
+      if (t > LOCAL)
+        big.resize(t);
+      b = t > LOCAL ? &big[0] : local;
+      e = b + t;
+      for (int d = 0; d < t; d++)
+      {
+        auto &r = b[d];
+        r.t = create ? createMov(c, d) : c->move(d);
+        r.d = d;
+        r.rev = r.t ? c->c.spin(d) : d;
+        r.mirror = r.t && c->c.mirror(d);
+      }
+    }
+    neighbor_records(const neighbor_records &) = delete;
+
+    neighbor_record *begin() const { return b; }
+    neighbor_record *end() const { return e; }
+    int size() const { return e - b; }
+    neighbor_record &operator[](int i) const { return b[i]; }
+  };
 #endif
 
   EX movei moveimon(cell *c)
@@ -631,4 +1286,322 @@ namespace hr
     return movei(f, t, -1);
   }
 
+#if !defined(NO_TAILORED_ALLOC) && !defined(NO_TAILORED_SLAB)
+  void *tailored_chunk::take()
+  {
+    if (freelist)
+    {
+      void *p = freelist;
+      freelist = *(void **)p;
+      return p;
+    }
+    if (bump + slab->size <= end)
+    {
+      void *p = bump;
+      bump += slab->size;
+      return p;
+    }
+    return nullptr;
+  }
+
+  /** \brief a block of tailored_chunk_size bytes, aligned to its size */
+  void *tailored_chunk_alloc()
+  {
+#ifdef _WIN32
+    void *p = _aligned_malloc(tailored_chunk_size, tailored_chunk_size);
+#else
+    void *p;
+    if (posix_memalign(&p, tailored_chunk_size, tailored_chunk_size))
+      p = nullptr;
+#endif
+    if (!p)
+      throw std::bad_alloc();
+    return p;
+  }
+
+  void *tailored_slab::alloc(size_t objsize)
+  {
+    if (!size)
+      size = objsize;
+    void *p = nullptr;
+    if (chunks)
+      p = chunks->take();
+    while (!p && !partial.empty())
+    {
+      auto ch = partial.back();
+      p = ch->take();
+      if (!ch->freelist)
+        ch->in_partial = false, partial.pop_back();
+    }
+    if (!p)
+    {
+      auto ch = (tailored_chunk *)tailored_chunk_alloc();
+      ch->slab = this;
+      ch->bump = (char *)ch + ((sizeof(tailored_chunk) + 63) & ~63);
+      ch->end = (char *)ch + tailored_chunk_size;
+      ch->freelist = nullptr;
+      ch->in_partial = false;
+      ch->next = chunks;
+      chunks = ch;
+      p = ch->take();
+    }
+    live++;
+    return p;
+  }
+
+  void tailored_slab::release(void *p)
+  {
+    auto ch = tailored_chunk_of(p);
+    *(void **)p = ch->freelist;
+    ch->freelist = p;
+    if (!ch->in_partial && ch != chunks)
+      ch->in_partial = true, partial.push_back(ch);
+    live--;
+  }
+#endif
+
+  hotcold_graph::hotcold_graph(const vector<cell *> &cells)
+  {
+    for (cell *c : cells)
+      if (ids.add(c))
+      {
+        hot.push_back(hot_cell{uint32_t(isize(neighbors)), (unsigned char)c->type});
+        cold.push_back(c);
+        neighbors.resize(isize(neighbors) + c->type);
+      }
+    spins.resize(isize(neighbors));
+    for (uint32_t id = 0; id < hot.size(); id++)
+    {
+      cell *c = cold[id];
+      for (int d = 0; d < c->type; d++)
+      {
+        cell *c2 = c->move(d);
+        int e = hot[id].first_edge + d;
+        neighbors[e] = c2 ? id_of(c2) : NOID;
+        spins[e] = c2 ? c->c.spin(d) | (c->c.mirror(d) ? 128 : 0) : 0;
+      }
+    }
+  }
+
+  vector<int> hotcold_graph::distances(uint32_t from, int maxdist) const
+  {
+    vector<int> dist(size(), -1);
+    /* the queue never exceeds size(), so it is allocated at most once, from the scratch arena */
+    arena_scope scope(scratch_arena());
+    small_vector<uint32_t, 64> q(&scope.arena);
+    q.reserve(size());
+    q.push_back(from);
+    dist[from] = 0;
+    for (int i = 0; i < isize(q); i++)
+    {
+      uint32_t id = q[i];
+      if (dist[id] == maxdist)
+        continue;
+      auto &h = hot[id];
+      for (int d = 0; d < h.type; d++)
+      {
+        uint32_t id2 = neighbors[h.first_edge + d];
+        if (id2 != NOID && dist[id2] < 0)
+          dist[id2] = dist[id] + 1, q.push_back(id2);
+      }
+    }
+    return dist;
+  }
+
+#if CAP_THREAD
+  void concurrent_cellset::init(int size)
+  {
+    keys = vector<std::atomic<cell *>>(size);
+    for (auto &k : keys)
+      k.store(nullptr, std::memory_order_relaxed);
+    values.assign(size, -1);
+    mask = size - 1;
+  }
+
+  int concurrent_cellset::insert(cell *c)
+  {
+    size_t h = reentrant_manual_celllister::hash(c) & mask;
+    while (true)
+    {
+      cell *cur = keys[h].load(std::memory_order_acquire);
+      if (cur == c)
+        return -1;
+      if (cur)
+      {
+        h = (h + 1) & mask;
+        continue;
+      }
+      /* if we lose the race, look at the same slot again */
+      if (keys[h].compare_exchange_strong(cur, c, std::memory_order_acq_rel))
+        return h;
+    }
+  }
+
+  int concurrent_cellset::find(cell *c) const
+  {
+    if (keys.empty())
+      return -1;
+    size_t h = reentrant_manual_celllister::hash(c) & mask;
+    while (true)
+    {
+      cell *cur = keys[h].load(std::memory_order_acquire);
+      if (cur == c)
+        return h;
+      if (!cur)
+        return -1;
+      h = (h + 1) & mask;
+    }
+  }
+
+  bfs_worker_pool::~bfs_worker_pool()
+  {
+    if (workers.empty())
+      return;
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      quit = true;
+    }
+    start.notify_all();
+    for (auto &th : workers)
+      th.join();
+  }
+
+  void bfs_worker_pool::run(int t)
+  {
+    int seen = 0;
+    std::unique_lock<std::mutex> lk(lock);
+    while (true)
+    {
+      start.wait(lk, [&] { return quit || generation != seen; });
+      if (quit)
+        return;
+      seen = generation;
+      if (t >= used)
+        continue;
+      auto job_here = job;
+      lk.unlock();
+      (*job_here)(t);
+      lk.lock();
+      if (--pending == 0)
+        done.notify_one();
+    }
+  }
+
+  void bfs_worker_pool::execute(int qty, const std::function<void(int)> &f)
+  {
+    if (qty <= 1)
+    {
+      f(0);
+      return;
+    }
+    /* the workers are only started when a level is first large enough to split */
+    if (workers.empty())
+      for (int t = 1; t < size; t++)
+        workers.emplace_back([this, t] { run(t); });
+    {
+      std::lock_guard<std::mutex> lk(lock);
+      job = &f;
+      used = qty;
+      pending = qty - 1;
+      generation++;
+    }
+    start.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> lk(lock);
+    done.wait(lk, [&] { return pending == 0; });
+  }
+
+  parallel_celllister::parallel_celllister(cell *orig, int maxdist, int maxcount, cell *breakon, int threads)
+  {
+    if (threads <= 0)
+      threads = max<int>(1, std::thread::hardware_concurrency());
+
+    marks.init(16);
+    auto add = [&](int slot, cell *c, int d)
+    {
+      marks.values[slot] = isize(lst);
+      lst.push_back(c);
+      dists.push_back(d);
+    };
+    add(marks.insert(orig), orig, 0);
+
+    struct thread_result
+    {
+      vector<pair<int, cell *>> found;
+      vector<pair<cell *, int>> to_generate;
+    };
+    vector<thread_result> results(threads);
+    bfs_worker_pool pool(threads);
+
+    bfs_by_levels(lst, maxdist, maxcount, [&](int level_start, int level_end, int d)
+    {
+      /* make sure that the table stays at most half full, even if all the edges lead to new cells */
+      int needed = level_end;
+      for (int i = level_start; i < level_end; i++)
+        needed += lst[i]->type;
+      if (2 * needed > isize(marks.keys))
+      {
+        int size = isize(marks.keys);
+        while (2 * needed > size)
+          size *= 2;
+        marks.init(size);
+        for (int i = 0; i < isize(lst); i++)
+          marks.values[marks.insert(lst[i])] = i;
+      }
+
+      int qty = level_end - level_start;
+      int used = min(threads, (qty + 255) / 256);
+      std::function<void(int)> work = [&](int t)
+      {
+        auto &res = results[t];
+        res.found.clear();
+        res.to_generate.clear();
+        for (int i = level_start + qty * t / used; i < level_start + qty * (t + 1) / used; i++)
+        {
+          cell *c = lst[i];
+          for (int j = 0; j < c->type; j++)
+          {
+            cell *c2 = c->move(j);
+            if (!c2)
+            {
+              res.to_generate.emplace_back(c, j);
+              continue;
+            }
+            int slot = marks.insert(c2);
+            if (slot >= 0)
+              res.found.emplace_back(slot, c2);
+          }
+        }
+      };
+
+      pool.execute(used, work);
+
+      bool found_breakon = false;
+      for (int t = 0; t < used; t++)
+        for (auto &p : results[t].found)
+        {
+          add(p.first, p.second, d + 1);
+          if (p.second == breakon)
+            found_breakon = true;
+        }
+
+      /* the generation queue: only this thread creates cells */
+      for (int t = 0; t < used; t++)
+        for (auto &p : results[t].to_generate)
+        {
+          cell *c2 = createMov(p.first, p.second);
+          int slot = marks.insert(c2);
+          if (slot >= 0)
+          {
+            add(slot, c2, d + 1);
+            if (c2 == breakon)
+              found_breakon = true;
+          }
+        }
+
+      return found_breakon;
+    });
+  }
+#endif
+
 }
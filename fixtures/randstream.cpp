@@ -0,0 +1,94 @@
+// Hyperbolic Rogue -- reproducible random streams
+// Copyright (C) 2011-2019 Zeno Rogue, see 'hyper.cpp' for details
+
+/** \file randstream.cpp
+ *  \brief counter-based random streams, for generation which is reproducible independently of the order of computation
+ *
+ *  A stream is identified by (seed, id, purpose), where id identifies the object being generated
+ *  (e.g., a cell or heptagon, given by some coordinate which does not depend on the order of
+ *  generation) and purpose says what it is generated for. The n-th number of a stream is a hash of
+ *  its key and n, so streams are cheap to create, independent of each other, and give the same
+ *  results regardless of which thread uses them and when.
+ *
+ *  Existing code can be switched gradually: shrand and srandd use the stream installed by a
+ *  stream_guard in the current thread, and fall back to hrand and randd otherwise.
+ */
+
+#include "hyper.h"
+namespace hr {
+
+#if HDR
+/** \brief the splitmix64 finalizer */
+inline unsigned long long rng_mix(unsigned long long z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+  return z ^ (z >> 31);
+  }
+
+/** \brief turn a name into a purpose, e.g., rng_purpose("land") */
+inline unsigned long long rng_purpose(const char *s) {
+  unsigned long long h = 0xcbf29ce484222325ull;
+  while(*s) h = (h ^ (unsigned char) *s++) * 0x100000001b3ull;
+  return h;
+  }
+
+struct rng_stream {
+  unsigned long long key, counter;
+
+  rng_stream(unsigned long long seed, unsigned long long id, unsigned long long purpose) :
+    key(rng_mix(rng_mix(rng_mix(seed) ^ id) ^ purpose)), counter(0) {}
+
+  /** \brief the n-th number of this stream */
+  unsigned long long at(unsigned long long n) const { return rng_mix(key + (n + 1) * 0x9E3779B97F4A7C15ull); }
+
+  unsigned long long next() { return at(counter++); }
+
+  /** \brief a substream for a sub-purpose, independent of how much of this stream has been used */
+  rng_stream split(unsigned long long purpose) const { return rng_stream(key, 0, purpose); }
+
+  /** \brief like hrand: uniform in [0, i) */
+  int rand(int i) { return int(((next() >> 32) * (unsigned long long) i) >> 32); }
+
+  /** \brief like randd: uniform in [0, 1) */
+  ld randd() { return (next() >> 11) * (1. / 9007199254740992.); }
+
+  /** \brief so that it can be used with std::shuffle etc., like hrngen */
+  typedef unsigned result_type;
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return 0xFFFFFFFF; }
+  result_type operator()() { return next() >> 32; }
+  };
+
+/** \brief install a stream for shrand and srandd in the current thread, restoring the previous one on destruction */
+struct stream_guard {
+  rng_stream *saved;
+  explicit stream_guard(rng_stream& s);
+  ~stream_guard();
+  };
+#endif
+
+/** \brief the seed used by streams created with make_stream; reset it to reproduce a world */
+EX unsigned long long stream_seed = 0;
+
+EX rng_stream make_stream(unsigned long long id, unsigned long long purpose) {
+  return rng_stream(stream_seed, id, purpose);
+  }
+
+thread_local rng_stream *active_stream = nullptr;
+
+stream_guard::stream_guard(rng_stream& s) : saved(active_stream) { active_stream = &s; }
+stream_guard::~stream_guard() { active_stream = saved; }
+
+/** \brief hrand(i), taken from the active stream if there is one */
+EX int shrand(int i) {
+  if(active_stream) return active_stream->rand(i);
+  return hrand(i);
+  }
+
+/** \brief randd(), taken from the active stream if there is one */
+EX ld srandd() {
+  if(active_stream) return active_stream->randd();
+  return randd();
+  }
+
+}
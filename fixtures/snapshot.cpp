@@ -0,0 +1,348 @@
+// Hyperbolic Rogue -- cell graph snapshots
+// Copyright (C) 2011-2019 Zeno Rogue, see 'hyper.cpp' for details
+
+/** \file snapshot.cpp
+ *  \brief binary snapshots of the cell graph, which can be memory-mapped and used directly
+ *
+ *  A snapshot stores a set of cells, optionally their heptagons, their connection tables
+ *  (with spins and mirror flags) and their gcell data. All links are 32-bit indices into the
+ *  snapshot's own tables, and all the tables are at fixed, aligned offsets given in the header,
+ *  so a snapshot_view just maps the file and reads the tables in place, without any
+ *  deserialization pass. snapshot_view::instantiate builds a live pointer graph from it if needed.
+ */
+
+#include "hyper.h"
+#if !ISWINDOWS && !ISWEB
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace hr {
+
+#if HDR
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const uint32_t SNAPSHOT_NOID = uint32_t(-1);
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;
+  /** \brief gcell data is stored as raw bytes, so this has to agree with the reader */
+  uint32_t gcell_size;
+  uint32_t geometry, variation;
+  uint32_t cell_count, cell_edge_count, hept_count, hept_edge_count;
+  /** \brief the index of the origin cell */
+  uint32_t origin;
+  /** \brief offsets of the tables, from the start of the file */
+  uint64_t cells_at, cell_edges_at, cell_spins_at, gcells_at, hepts_at, hept_edges_at, hept_spins_at;
+  uint64_t total_size;
+  /** \brief FNV-1a of everything after the header */
+  uint64_t checksum;
+  };
+
+struct snapshot_cell {
+  uint32_t first_edge;
+  /** \brief index of the master heptagon, or SNAPSHOT_NOID */
+  uint32_t master;
+  uint8_t type;
+  uint8_t pad[3];
+  };
+
+struct snapshot_heptagon {
+  uint32_t first_edge;
+  /** \brief index of the central cell, or SNAPSHOT_NOID */
+  uint32_t c7;
+  uint8_t type, s, dm4, pad;
+  int16_t distance, emeraldval, fiftyval, zebraval, rval0, rval1;
+  int32_t fieldval;
+  };
+
+/** \brief a snapshot opened for reading; the tables are used in place */
+struct snapshot_view {
+  const char *data = nullptr;
+  size_t size = 0;
+  /** \brief the memory-mapped file, or nullptr if read into buffer */
+  void *mapped = nullptr;
+  vector<char> buffer;
+
+  snapshot_view() {}
+  snapshot_view(const snapshot_view&) = delete;
+  snapshot_view& operator = (const snapshot_view&) = delete;
+  ~snapshot_view() { close(); }
+  void close();
+
+  const snapshot_header& header() const { return *(const snapshot_header*) data; }
+  template<class T> const T* table(uint64_t at) const { return (const T*) (data + at); }
+
+  int cell_count() const { return header().cell_count; }
+  int hept_count() const { return header().hept_count; }
+  const snapshot_cell& cell_at(uint32_t id) const { return table<snapshot_cell>(header().cells_at)[id]; }
+  const snapshot_heptagon& hept_at(uint32_t id) const { return table<snapshot_heptagon>(header().hepts_at)[id]; }
+  /** \brief index of the neighbor of cell id in direction d, or SNAPSHOT_NOID */
+  uint32_t move(uint32_t id, int d) const { return table<uint32_t>(header().cell_edges_at)[cell_at(id).first_edge + d]; }
+  int spin(uint32_t id, int d) const { return table<uint8_t>(header().cell_spins_at)[cell_at(id).first_edge + d] & 127; }
+  bool mirror(uint32_t id, int d) const { return table<uint8_t>(header().cell_spins_at)[cell_at(id).first_edge + d] & 128; }
+  uint32_t hept_move(uint32_t id, int d) const { return table<uint32_t>(header().hept_edges_at)[hept_at(id).first_edge + d]; }
+  int hept_spin(uint32_t id, int d) const { return table<uint8_t>(header().hept_spins_at)[hept_at(id).first_edge + d] & 127; }
+  bool hept_mirror(uint32_t id, int d) const { return table<uint8_t>(header().hept_spins_at)[hept_at(id).first_edge + d] & 128; }
+  /** \brief the gameplay data of cell id */
+  const gcell& game(uint32_t id) const { return *(const gcell*) (data + header().gcells_at + size_t(id) * header().gcell_size); }
+
+  /** \brief was this snapshot saved in the current geometry and variation */
+  bool matches_current() const { return header().geometry == uint32_t(geometry) && header().variation == uint32_t(variation); }
+
+  /** \brief create live cells and heptagons from this snapshot; indices in cells/hepts agree with the snapshot;
+   *  throws hr_exception if it was saved in a different geometry or variation
+   */
+  void instantiate(vector<cell*>& cells, vector<heptagon*>& hepts) const;
+  };
+#endif
+
+EX uint64_t snapshot_checksum(const char *p, size_t n) {
+  uint64_t h = 0xcbf29ce484222325ull;
+  for(size_t i=0; i<n; i++) h = (h ^ (unsigned char) p[i]) * 0x100000001b3ull;
+  return h;
+  }
+
+size_t snapshot_align(size_t x) { return (x + 7) & ~size_t(7); }
+
+/** \brief save the given cells (and, if with_heptagons, their masters) to fname
+ *
+ *  Edges leading outside of the saved set are stored as SNAPSHOT_NOID. with_heptagons should be false
+ *  in geometries where cell::master does not point to a heptagon.
+ */
+EX bool save_snapshot(const string& fname, cell *origin, const vector<cell*>& cells, bool with_heptagons) {
+  reentrant_manual_celllister cids;
+  for(cell *c: cells) cids.add(c);
+  cids.add(origin);
+
+  vector<heptagon*> hepts;
+  map<heptagon*, uint32_t> hids;
+  if(with_heptagons) for(cell *c: cids.lst)
+    if(c->master && !hids.count(c->master)) hids[c->master] = isize(hepts), hepts.push_back(c->master);
+
+  auto cid = [&] (cell *c) { int i = c ? cids.index_of(c) : -1; return i < 0 ? SNAPSHOT_NOID : uint32_t(i); };
+  auto hid = [&] (heptagon *h) { auto it = h ? hids.find(h) : hids.end(); return it == hids.end() ? SNAPSHOT_NOID : it->second; };
+
+  snapshot_header hd;
+  memset(&hd, 0, sizeof(hd));
+  memcpy(hd.magic, "HRSNAP\0\0", 8);
+  hd.version = SNAPSHOT_VERSION;
+  hd.header_size = sizeof(snapshot_header);
+  hd.gcell_size = sizeof(gcell);
+  hd.geometry = geometry;
+  hd.variation = int(variation);
+  hd.cell_count = isize(cids.lst);
+  hd.hept_count = isize(hepts);
+  hd.origin = cid(origin);
+  for(cell *c: cids.lst) hd.cell_edge_count += c->type;
+  for(heptagon *h: hepts) hd.hept_edge_count += h->type;
+
+  size_t at = snapshot_align(sizeof(snapshot_header));
+  auto alloc = [&] (uint64_t& where, size_t bytes) { where = at; at = snapshot_align(at + bytes); };
+  alloc(hd.cells_at, sizeof(snapshot_cell) * hd.cell_count);
+  alloc(hd.cell_edges_at, 4 * hd.cell_edge_count);
+  alloc(hd.cell_spins_at, hd.cell_edge_count);
+  alloc(hd.gcells_at, sizeof(gcell) * hd.cell_count);
+  alloc(hd.hepts_at, sizeof(snapshot_heptagon) * hd.hept_count);
+  alloc(hd.hept_edges_at, 4 * hd.hept_edge_count);
+  alloc(hd.hept_spins_at, hd.hept_edge_count);
+  hd.total_size = at;
+
+  vector<char> out(at, 0);
+  auto sc = (snapshot_cell*) &out[hd.cells_at];
+  auto ce = (uint32_t*) &out[hd.cell_edges_at];
+  auto cs = (uint8_t*) &out[hd.cell_spins_at];
+  uint32_t e = 0;
+  for(int i=0; i<isize(cids.lst); i++) {
+    cell *c = cids.lst[i];
+    sc[i].first_edge = e;
+    sc[i].master = hid(c->master);
+    sc[i].type = c->type;
+    for(int d=0; d<c->type; d++, e++) {
+      ce[e] = cid(c->move(d));
+      cs[e] = c->move(d) ? c->c.spin(d) | (c->c.mirror(d) ? 128 : 0) : 0;
+      }
+    memcpy(&out[hd.gcells_at + sizeof(gcell) * i], (gcell*) c, sizeof(gcell));
+    }
+
+  auto sh = (snapshot_heptagon*) &out[hd.hepts_at];
+  auto he = (uint32_t*) &out[hd.hept_edges_at];
+  auto hs = (uint8_t*) &out[hd.hept_spins_at];
+  e = 0;
+  for(int i=0; i<isize(hepts); i++) {
+    heptagon *h = hepts[i];
+    auto& s = sh[i];
+    s.first_edge = e;
+    s.c7 = cid(h->c7);
+    s.type = h->type; s.s = h->s; s.dm4 = h->dm4;
+    s.distance = h->distance; s.emeraldval = h->emeraldval; s.fiftyval = h->fiftyval; s.zebraval = h->zebraval;
+    s.rval0 = h->rval0; s.rval1 = h->rval1; s.fieldval = h->fieldval;
+    for(int d=0; d<h->type; d++, e++) {
+      he[e] = hid(h->move(d));
+      hs[e] = h->move(d) ? h->c.spin(d) | (h->c.mirror(d) ? 128 : 0) : 0;
+      }
+    }
+
+  size_t hsize = snapshot_align(sizeof(snapshot_header));
+  hd.checksum = snapshot_checksum(&out[hsize], at - hsize);
+  memcpy(&out[0], &hd, sizeof(hd));
+
+  FILE *f = fopen(fname.c_str(), "wb");
+  if(!f) return false;
+  bool ok = fwrite(&out[0], 1, at, f) == at;
+  fclose(f);
+  return ok;
+  }
+
+void snapshot_view::close() {
+  #if !ISWINDOWS && !ISWEB
+  if(mapped) munmap(mapped, size);
+  #endif
+  mapped = nullptr;
+  buffer.clear();
+  data = nullptr;
+  size = 0;
+  }
+
+/** \brief open a snapshot, memory-mapping it where possible; only the header is checked here, see validate_snapshot */
+EX bool open_snapshot(const string& fname, snapshot_view& v) {
+  v.close();
+  #if !ISWINDOWS && !ISWEB
+  int fd = open(fname.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(snapshot_header)) {
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(p != MAP_FAILED) v.mapped = p, v.data = (const char*) p, v.size = st.st_size;
+    }
+  ::close(fd);
+  #endif
+  if(!v.data) {
+    FILE *f = fopen(fname.c_str(), "rb");
+    if(!f) return false;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(n > 0) {
+      v.buffer.resize(n);
+      if(fread(&v.buffer[0], 1, n, f) != size_t(n)) v.buffer.clear();
+      }
+    fclose(f);
+    if(v.buffer.empty()) return false;
+    v.data = &v.buffer[0];
+    v.size = v.buffer.size();
+    }
+  if(v.size < sizeof(snapshot_header) || memcmp(v.header().magic, "HRSNAP\0\0", 8) || v.header().version != SNAPSHOT_VERSION || v.header().total_size != v.size) {
+    v.close();
+    return false;
+    }
+  return true;
+  }
+
+/** \brief check the snapshot thoroughly; returns the description of the first problem found, or "" if it is fine */
+EX string validate_snapshot(const snapshot_view& v) {
+  if(!v.data) return "not open";
+  auto& hd = v.header();
+  if(hd.header_size != sizeof(snapshot_header)) return "header size mismatch";
+  if(hd.gcell_size != sizeof(gcell)) return "gcell size mismatch: " + its(hd.gcell_size) + " vs " + its(sizeof(gcell));
+  if(!v.matches_current())
+    return "geometry mismatch: saved in geometry " + its(hd.geometry) + " variation " + its(hd.variation) + ", current is " + its(int(geometry)) + " variation " + its(int(variation));
+  auto in_file = [&] (uint64_t at, uint64_t bytes) { return at % 4 == 0 && at <= v.size && bytes <= v.size - at; };
+  if(!in_file(hd.cells_at, uint64_t(sizeof(snapshot_cell)) * hd.cell_count)) return "cell table out of bounds";
+  if(!in_file(hd.cell_edges_at, uint64_t(4) * hd.cell_edge_count)) return "cell edge table out of bounds";
+  if(!in_file(hd.cell_spins_at, hd.cell_edge_count)) return "cell spin table out of bounds";
+  if(!in_file(hd.gcells_at, uint64_t(sizeof(gcell)) * hd.cell_count)) return "gcell table out of bounds";
+  if(!in_file(hd.hepts_at, uint64_t(sizeof(snapshot_heptagon)) * hd.hept_count)) return "heptagon table out of bounds";
+  if(!in_file(hd.hept_edges_at, uint64_t(4) * hd.hept_edge_count)) return "heptagon edge table out of bounds";
+  if(!in_file(hd.hept_spins_at, hd.hept_edge_count)) return "heptagon spin table out of bounds";
+  size_t hsize = snapshot_align(sizeof(snapshot_header));
+  if(snapshot_checksum(v.data + hsize, v.size - hsize) != hd.checksum) return "checksum mismatch";
+  if(hd.origin >= hd.cell_count) return "bad origin";
+
+  for(uint32_t i=0; i<hd.cell_count; i++) {
+    auto& c = v.cell_at(i);
+    if(c.type > FULL_EDGE || uint64_t(c.first_edge) + c.type > hd.cell_edge_count) return "bad edges of cell " + its(i);
+    if(c.master != SNAPSHOT_NOID && c.master >= hd.hept_count) return "bad master of cell " + its(i);
+    }
+  for(uint32_t i=0; i<hd.cell_count; i++) for(int d=0; d<v.cell_at(i).type; d++) {
+    uint32_t j = v.move(i, d);
+    if(j == SNAPSHOT_NOID) continue;
+    if(j >= hd.cell_count) return "bad neighbor of cell " + its(i);
+    int d1 = v.spin(i, d);
+    if(d1 >= v.cell_at(j).type || v.move(j, d1) != i || v.spin(j, d1) != d || v.mirror(j, d1) != v.mirror(i, d))
+      return "connection of cell " + its(i) + " in direction " + its(d) + " is not symmetric";
+    }
+
+  for(uint32_t i=0; i<hd.hept_count; i++) {
+    auto& h = v.hept_at(i);
+    if(h.type > FULL_EDGE || uint64_t(h.first_edge) + h.type > hd.hept_edge_count) return "bad edges of heptagon " + its(i);
+    if(h.c7 != SNAPSHOT_NOID && h.c7 >= hd.cell_count) return "bad c7 of heptagon " + its(i);
+    }
+  for(uint32_t i=0; i<hd.hept_count; i++) for(int d=0; d<v.hept_at(i).type; d++) {
+    uint32_t j = v.hept_move(i, d);
+    if(j == SNAPSHOT_NOID) continue;
+    if(j >= hd.hept_count) return "bad neighbor of heptagon " + its(i);
+    int d1 = v.hept_spin(i, d);
+    if(d1 >= v.hept_at(j).type || v.hept_move(j, d1) != i || v.hept_spin(j, d1) != d)
+      return "connection of heptagon " + its(i) + " in direction " + its(d) + " is not symmetric";
+    }
+  return "";
+  }
+
+void snapshot_view::instantiate(vector<cell*>& cells, vector<heptagon*>& hepts) const {
+  if(!matches_current()) throw hr_exception("snapshot saved in a different geometry or variation");
+  auto& hd = header();
+  hepts.resize(hd.hept_count);
+  for(uint32_t i=0; i<hd.hept_count; i++) {
+    auto& s = hept_at(i);
+    heptagon *h = hepts[i] = tailored_alloc<heptagon> (s.type);
+    h->s = hstate(s.s); h->dm4 = s.dm4;
+    h->distance = s.distance; h->emeraldval = s.emeraldval; h->fiftyval = s.fiftyval; h->zebraval = s.zebraval;
+    h->rval0 = s.rval0; h->rval1 = s.rval1; h->fieldval = s.fieldval;
+    h->cdata = nullptr; h->alt = nullptr; h->c7 = nullptr;
+    }
+  cells.resize(hd.cell_count);
+  for(uint32_t i=0; i<hd.cell_count; i++) {
+    auto& s = cell_at(i);
+    cell *c = cells[i] = tailored_alloc<cell> (s.type);
+    memcpy((gcell*) c, &game(i), sizeof(gcell));
+    c->master = s.master == SNAPSHOT_NOID ? nullptr : hepts[s.master];
+    }
+  for(uint32_t i=0; i<hd.hept_count; i++) {
+    auto& s = hept_at(i);
+    if(s.c7 != SNAPSHOT_NOID) hepts[i]->c7 = cells[s.c7];
+    for(int d=0; d<s.type; d++) {
+      uint32_t j = hept_move(i, d);
+      if(j != SNAPSHOT_NOID) hepts[i]->c.connect(d, hepts[j], hept_spin(i, d), hept_mirror(i, d));
+      }
+    }
+  for(uint32_t i=0; i<hd.cell_count; i++)
+    for(int d=0; d<cell_at(i).type; d++) {
+      uint32_t j = move(i, d);
+      if(j != SNAPSHOT_NOID) cells[i]->c.connect(d, cells[j], spin(i, d), mirror(i, d));
+      }
+  }
+
+#if CAP_COMMANDLINE
+int read_snapshot_args() {
+  using namespace arg;
+  if(argis("-snapshot-check")) {
+    shift();
+    snapshot_view v;
+    if(!open_snapshot(args(), v)) println(hlog, "snapshot ", args(), ": cannot open");
+    else {
+      string err = validate_snapshot(v);
+      println(hlog, "snapshot ", args(), ": ", v.cell_count(), " cells, ", v.hept_count(), " heptagons, ", err == "" ? "OK" : err);
+      }
+    }
+  else return 1;
+  return 0;
+  }
+
+auto ah_snapshot = addHook(hooks_args, 100, read_snapshot_args);
+#endif
+
+}
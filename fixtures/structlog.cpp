@@ -0,0 +1,325 @@
+// Hyperbolic Rogue -- buffered structured logging
+// Copyright (C) 2011-2019 Zeno Rogue, see 'hyper.cpp' for details
+
+/** \file structlog.cpp
+ *  \brief buffered, rate-limited logging for warnings from hot code
+ *
+ *  SLOG(...) captures its arguments by value (numbers, string literals, hyperpoints and
+ *  transmatrices) into a ring buffer owned by the calling thread, without formatting and
+ *  without locks. Once slog::open_binary() has opened a file, the records are written to it in a
+ *  binary format by a background flusher thread (with CAP_THREAD); otherwise they are formatted
+ *  to hlog by slog::flush(), which is called on the main thread every frame and at exit (without
+ *  threads, right after each record). hlog is not synchronized, so the flusher never prints to
+ *  it. Every SLOG call site is limited to slog::rate_limit messages per slog::rate_window; the
+ *  number of suppressed messages is reported with the next one.
+ */
+
+#include "hyper.h"
+namespace hr {
+
+#if HDR
+#define SLOG(...) do { static slog::log_site slog_site_(__FILE__, __LINE__); slog::emit(slog_site_, __VA_ARGS__); } while(0)
+#endif
+
+EX namespace slog {
+
+#if HDR
+  enum eLogKind : unsigned char { lkInt, lkFloat, lkString, lkPoint, lkMatrix };
+
+  static const int max_log_args = 6;
+  static const int log_slots = 24;
+  static const int ring_size = 512;
+
+  struct log_site {
+    const char *file;
+    int line;
+    /** \brief assigned when first written to the binary log */
+    int id;
+    std::atomic<long long> window_start;
+    std::atomic<int> in_window;
+    std::atomic<long long> suppressed;
+    log_site(const char *f, int l) : file(f), line(l), id(-1), window_start(0), in_window(0), suppressed(0) {}
+    };
+
+  union log_slot {
+    ld x;
+    long long i;
+    const char *s;
+    };
+
+  struct log_record {
+    log_site *site;
+    long long time;
+    long long suppressed;
+    int nargs, nslots;
+    eLogKind kind[max_log_args];
+    unsigned char at[max_log_args];
+    log_slot data[log_slots];
+    /** \brief reserve n slots for an argument of kind k; returns nullptr if it does not fit */
+    log_slot *add(eLogKind k, int n) {
+      if(nargs == max_log_args || nslots + n > log_slots) return nullptr;
+      kind[nargs] = k;
+      at[nargs++] = nslots;
+      nslots += n;
+      return data + nslots - n;
+      }
+    };
+
+  /** \brief a single-producer single-consumer ring; the producer is the owning thread, the consumer is flush() */
+  struct log_ring {
+    array<log_record, ring_size> records;
+    std::atomic<unsigned> head, tail;
+    std::atomic<long long> dropped;
+    int thread_id;
+    log_ring(int id) : head(0), tail(0), dropped(0), thread_id(id) {}
+    };
+
+  template<class T> typename std::enable_if<std::is_integral<T>::value>::type capture(log_record& r, T x) {
+    if(auto s = r.add(lkInt, 1)) s->i = x;
+    }
+
+  template<class T> typename std::enable_if<std::is_floating_point<T>::value>::type capture(log_record& r, T x) {
+    if(auto s = r.add(lkFloat, 1)) s->x = x;
+    }
+
+  /** \brief only the pointer is kept, so this should be used with string literals */
+  inline void capture(log_record& r, const char *str) {
+    if(auto s = r.add(lkString, 1)) s->s = str;
+    }
+
+  inline void capture(log_record& r, const hyperpoint& h) {
+    if(auto s = r.add(lkPoint, MAXMDIM)) for(int i=0; i<MAXMDIM; i++) s[i].x = h[i];
+    }
+
+  inline void capture(log_record& r, const transmatrix& T) {
+    if(auto s = r.add(lkMatrix, MAXMDIM*MAXMDIM)) for(int i=0; i<MAXMDIM; i++) for(int j=0; j<MAXMDIM; j++) s[i*MAXMDIM+j].x = T[i][j];
+    }
+
+  inline void capture_all(log_record& r) {}
+  template<class T, class... U> void capture_all(log_record& r, const T& x, const U&... u) { capture(r, x); capture_all(r, u...); }
+
+  log_record *start_record(log_site& site);
+  void finish_record();
+
+  template<class... T> void emit(log_site& site, const T&... args) {
+    log_record *r = start_record(site);
+    if(!r) return;
+    capture_all(*r, args...);
+    finish_record();
+    }
+#endif
+
+  /** \brief at most this many messages from a single call site are logged in a rate_window */
+  EX int rate_limit = 10;
+
+  /** \brief in milliseconds */
+  EX int rate_window = 1000;
+
+  /** \brief how often the flusher thread runs, in milliseconds */
+  EX int flush_interval = 20;
+
+  /** \brief if set, flush() writes binary records here instead of formatting to hlog */
+  EX FILE *binary_output;
+
+  std::mutex rings_lock, flush_lock;
+  vector<shared_ptr<log_ring>> rings;
+  thread_local shared_ptr<log_ring> my_ring;
+  int next_site_id;
+
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+  long long now_nanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+  bool allow(log_site& site, long long now) {
+    long long start = site.window_start.load(std::memory_order_relaxed);
+    if(now - start > rate_window * 1000000ll && site.window_start.compare_exchange_strong(start, now))
+      site.in_window.store(0, std::memory_order_relaxed);
+    if(site.in_window.fetch_add(1, std::memory_order_relaxed) < rate_limit) return true;
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+    }
+
+  #if CAP_THREAD
+  std::atomic<bool> flusher_running;
+  std::thread flusher;
+  void start_flusher();
+  void stop_flusher();
+
+  /** \brief make sure that stop_flusher runs at exit; registered lazily, so that it runs before hlog is destroyed */
+  void flush_at_exit() {
+    static bool registered = (atexit(stop_flusher), true);
+    (void) registered;
+    }
+  #endif
+
+  /** \brief returns the slot for a new record in this thread's ring, or nullptr if rate-limited or the ring is full */
+  log_record *start_record(log_site& site) {
+    long long now = now_nanos();
+    if(!allow(site, now)) return nullptr;
+    #if CAP_THREAD
+    flush_at_exit();
+    #endif
+    if(!my_ring) {
+      std::lock_guard<std::mutex> lock(rings_lock);
+      my_ring = make_shared<log_ring>(isize(rings));
+      rings.push_back(my_ring);
+      }
+    auto& ring = *my_ring;
+    unsigned h = ring.head.load(std::memory_order_relaxed);
+    if(h - ring.tail.load(std::memory_order_acquire) >= ring_size) {
+      ring.dropped++;
+      return nullptr;
+      }
+    auto& r = ring.records[h % ring_size];
+    r.site = &site;
+    r.time = now;
+    r.suppressed = site.suppressed.exchange(0, std::memory_order_relaxed);
+    r.nargs = r.nslots = 0;
+    return &r;
+    }
+
+  void finish_record() {
+    my_ring->head.fetch_add(1, std::memory_order_release);
+    #if !CAP_THREAD
+    flush();
+    #endif
+    }
+
+  void format_record(const log_record& r) {
+    for(int a=0; a<r.nargs; a++) {
+      const log_slot *s = r.data + r.at[a];
+      switch(r.kind[a]) {
+        case lkInt: print(hlog, s->i); break;
+        case lkFloat: print(hlog, s->x); break;
+        case lkString: print(hlog, s->s); break;
+        case lkPoint: {
+          hyperpoint h;
+          for(int i=0; i<MAXMDIM; i++) h[i] = s[i].x;
+          print(hlog, h);
+          break;
+          }
+        case lkMatrix: {
+          transmatrix T;
+          for(int i=0; i<MAXMDIM; i++) for(int j=0; j<MAXMDIM; j++) T[i][j] = s[i*MAXMDIM+j].x;
+          print(hlog, T);
+          break;
+          }
+        }
+      }
+    if(r.suppressed) print(hlog, " (", r.suppressed, " similar messages suppressed)");
+    println(hlog);
+    }
+
+  template<class T> void write_raw(const T& x) { fwrite(&x, sizeof(T), 1, binary_output); }
+
+  void write_string(const char *s) {
+    uint16_t len = strlen(s);
+    write_raw(len);
+    fwrite(s, 1, len, binary_output);
+    }
+
+  /** \brief binary format: 'S' site records (id, line, file) precede the first 'R' record from that site;
+   *  an 'R' record is site id, time, thread, suppressed, the number of arguments, and the arguments,
+   *  each as a kind byte followed by int64, double, a length-prefixed string, or MAXMDIM or MAXMDIM^2 doubles
+   */
+  void write_record(const log_record& r, int thread_id) {
+    auto& site = *r.site;
+    if(site.id < 0) {
+      site.id = next_site_id++;
+      write_raw('S');
+      write_raw(int32_t(site.id));
+      write_raw(int32_t(site.line));
+      write_string(site.file);
+      }
+    write_raw('R');
+    write_raw(int32_t(site.id));
+    write_raw(int64_t(r.time));
+    write_raw(int32_t(thread_id));
+    write_raw(int64_t(r.suppressed));
+    write_raw(uint8_t(r.nargs));
+    for(int a=0; a<r.nargs; a++) {
+      const log_slot *s = r.data + r.at[a];
+      write_raw(uint8_t(r.kind[a]));
+      switch(r.kind[a]) {
+        case lkInt: write_raw(int64_t(s->i)); break;
+        case lkFloat: write_raw(double(s->x)); break;
+        case lkString: write_string(s->s); break;
+        case lkPoint: for(int i=0; i<MAXMDIM; i++) write_raw(double(s[i].x)); break;
+        case lkMatrix: for(int i=0; i<MAXMDIM*MAXMDIM; i++) write_raw(double(s[i].x)); break;
+        }
+      }
+    }
+
+  /** \brief write to fname instead of hlog, starting the flusher thread; the file starts with the magic "HRSLOG1\n" */
+  EX bool open_binary(const string& fname) {
+    if(1) {
+      std::lock_guard<std::mutex> lock(flush_lock);
+      if(binary_output) fclose(binary_output);
+      binary_output = fopen(fname.c_str(), "wb");
+      if(!binary_output) return false;
+      fwrite("HRSLOG1\n", 1, 8, binary_output);
+      next_site_id = 0;
+      }
+    #if CAP_THREAD
+    start_flusher();
+    #endif
+    return true;
+    }
+
+  /** \brief write all the records collected so far; without binary_output, they are formatted to hlog only if to_text is set, and stay in the rings otherwise */
+  void drain(bool to_text) {
+    std::lock_guard<std::mutex> lock(flush_lock);
+    if(!binary_output && !to_text) return;
+    vector<shared_ptr<log_ring>> all;
+    if(1) {
+      std::lock_guard<std::mutex> lock2(rings_lock);
+      all = rings;
+      }
+    for(auto& pr: all) {
+      auto& ring = *pr;
+      unsigned t = ring.tail.load(std::memory_order_relaxed);
+      unsigned h = ring.head.load(std::memory_order_acquire);
+      for(; t != h; t++) {
+        auto& r = ring.records[t % ring_size];
+        if(binary_output) write_record(r, ring.thread_id);
+        else format_record(r);
+        }
+      ring.tail.store(t, std::memory_order_release);
+      long long d = ring.dropped.exchange(0);
+      if(d && !binary_output) println(hlog, "(", d, " log messages dropped in thread ", ring.thread_id, ")");
+      }
+    if(binary_output) fflush(binary_output);
+    }
+
+  /** \brief format or write all the records collected so far; this prints to hlog, so it has to be called from the main thread */
+  EX void flush() { drain(true); }
+
+  auto ah_flush = addHook(hooks_frame, 100, [] { flush(); });
+
+  #if CAP_THREAD
+  /** \brief stop the flusher thread, flushing the remaining records */
+  EX void stop_flusher() {
+    if(flusher_running.exchange(false)) flusher.join();
+    flush();
+    }
+
+  void start_flusher() {
+    static std::mutex start_lock;
+    std::lock_guard<std::mutex> lock(start_lock);
+    if(flusher_running) return;
+    flush_at_exit();
+    flusher_running = true;
+    flusher = std::thread([] {
+      while(flusher_running) {
+        drain(false);
+        std::this_thread::sleep_for(std::chrono::milliseconds(flush_interval));
+        }
+      });
+    }
+  #endif
+
+  EX }
+
+}